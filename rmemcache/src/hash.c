@@ -0,0 +1,394 @@
+/*
+ * Hash functions used to distribute keys across servers.
+ *
+ * mc_md5() is a straightforward implementation of RFC 1321, used by the
+ * ketama continuum.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "hash.h"
+
+typedef unsigned int md5_word; /* at least 32 bits */
+
+#define MD5_F(x,y,z) (((x) & (y)) | (~(x) & (z)))
+#define MD5_G(x,y,z) (((x) & (z)) | ((y) & ~(z)))
+#define MD5_H(x,y,z) ((x) ^ (y) ^ (z))
+#define MD5_I(x,y,z) ((y) ^ ((x) | ~(z)))
+#define MD5_ROTL(x,n) ((((x) << (n)) | ((x) >> (32-(n)))) & 0xffffffff)
+#define MD5_STEP(f,a,b,c,d,x,t,s) \
+    (a) = (b) + MD5_ROTL(((a) + f((b),(c),(d)) + (x) + (t)) & 0xffffffff, (s))
+
+static void md5_block(md5_word st[4], const unsigned char *p){
+    md5_word a = st[0], b = st[1], c = st[2], d = st[3], x[16];
+    int i;
+
+    for (i = 0; i < 16; i++)
+	x[i] = (md5_word)p[i*4] | ((md5_word)p[i*4+1] << 8) |
+	    ((md5_word)p[i*4+2] << 16) | ((md5_word)p[i*4+3] << 24);
+
+    MD5_STEP(MD5_F,a,b,c,d,x[ 0],0xd76aa478, 7); MD5_STEP(MD5_F,d,a,b,c,x[ 1],0xe8c7b756,12);
+    MD5_STEP(MD5_F,c,d,a,b,x[ 2],0x242070db,17); MD5_STEP(MD5_F,b,c,d,a,x[ 3],0xc1bdceee,22);
+    MD5_STEP(MD5_F,a,b,c,d,x[ 4],0xf57c0faf, 7); MD5_STEP(MD5_F,d,a,b,c,x[ 5],0x4787c62a,12);
+    MD5_STEP(MD5_F,c,d,a,b,x[ 6],0xa8304613,17); MD5_STEP(MD5_F,b,c,d,a,x[ 7],0xfd469501,22);
+    MD5_STEP(MD5_F,a,b,c,d,x[ 8],0x698098d8, 7); MD5_STEP(MD5_F,d,a,b,c,x[ 9],0x8b44f7af,12);
+    MD5_STEP(MD5_F,c,d,a,b,x[10],0xffff5bb1,17); MD5_STEP(MD5_F,b,c,d,a,x[11],0x895cd7be,22);
+    MD5_STEP(MD5_F,a,b,c,d,x[12],0x6b901122, 7); MD5_STEP(MD5_F,d,a,b,c,x[13],0xfd987193,12);
+    MD5_STEP(MD5_F,c,d,a,b,x[14],0xa679438e,17); MD5_STEP(MD5_F,b,c,d,a,x[15],0x49b40821,22);
+
+    MD5_STEP(MD5_G,a,b,c,d,x[ 1],0xf61e2562, 5); MD5_STEP(MD5_G,d,a,b,c,x[ 6],0xc040b340, 9);
+    MD5_STEP(MD5_G,c,d,a,b,x[11],0x265e5a51,14); MD5_STEP(MD5_G,b,c,d,a,x[ 0],0xe9b6c7aa,20);
+    MD5_STEP(MD5_G,a,b,c,d,x[ 5],0xd62f105d, 5); MD5_STEP(MD5_G,d,a,b,c,x[10],0x02441453, 9);
+    MD5_STEP(MD5_G,c,d,a,b,x[15],0xd8a1e681,14); MD5_STEP(MD5_G,b,c,d,a,x[ 4],0xe7d3fbc8,20);
+    MD5_STEP(MD5_G,a,b,c,d,x[ 9],0x21e1cde6, 5); MD5_STEP(MD5_G,d,a,b,c,x[14],0xc33707d6, 9);
+    MD5_STEP(MD5_G,c,d,a,b,x[ 3],0xf4d50d87,14); MD5_STEP(MD5_G,b,c,d,a,x[ 8],0x455a14ed,20);
+    MD5_STEP(MD5_G,a,b,c,d,x[13],0xa9e3e905, 5); MD5_STEP(MD5_G,d,a,b,c,x[ 2],0xfcefa3f8, 9);
+    MD5_STEP(MD5_G,c,d,a,b,x[ 7],0x676f02d9,14); MD5_STEP(MD5_G,b,c,d,a,x[12],0x8d2a4c8a,20);
+
+    MD5_STEP(MD5_H,a,b,c,d,x[ 5],0xfffa3942, 4); MD5_STEP(MD5_H,d,a,b,c,x[ 8],0x8771f681,11);
+    MD5_STEP(MD5_H,c,d,a,b,x[11],0x6d9d6122,16); MD5_STEP(MD5_H,b,c,d,a,x[14],0xfde5380c,23);
+    MD5_STEP(MD5_H,a,b,c,d,x[ 1],0xa4beea44, 4); MD5_STEP(MD5_H,d,a,b,c,x[ 4],0x4bdecfa9,11);
+    MD5_STEP(MD5_H,c,d,a,b,x[ 7],0xf6bb4b60,16); MD5_STEP(MD5_H,b,c,d,a,x[10],0xbebfbc70,23);
+    MD5_STEP(MD5_H,a,b,c,d,x[13],0x289b7ec6, 4); MD5_STEP(MD5_H,d,a,b,c,x[ 0],0xeaa127fa,11);
+    MD5_STEP(MD5_H,c,d,a,b,x[ 3],0xd4ef3085,16); MD5_STEP(MD5_H,b,c,d,a,x[ 6],0x04881d05,23);
+    MD5_STEP(MD5_H,a,b,c,d,x[ 9],0xd9d4d039, 4); MD5_STEP(MD5_H,d,a,b,c,x[12],0xe6db99e5,11);
+    MD5_STEP(MD5_H,c,d,a,b,x[15],0x1fa27cf8,16); MD5_STEP(MD5_H,b,c,d,a,x[ 2],0xc4ac5665,23);
+
+    MD5_STEP(MD5_I,a,b,c,d,x[ 0],0xf4292244, 6); MD5_STEP(MD5_I,d,a,b,c,x[ 7],0x432aff97,10);
+    MD5_STEP(MD5_I,c,d,a,b,x[14],0xab9423a7,15); MD5_STEP(MD5_I,b,c,d,a,x[ 5],0xfc93a039,21);
+    MD5_STEP(MD5_I,a,b,c,d,x[12],0x655b59c3, 6); MD5_STEP(MD5_I,d,a,b,c,x[ 3],0x8f0ccc92,10);
+    MD5_STEP(MD5_I,c,d,a,b,x[10],0xffeff47d,15); MD5_STEP(MD5_I,b,c,d,a,x[ 1],0x85845dd1,21);
+    MD5_STEP(MD5_I,a,b,c,d,x[ 8],0x6fa87e4f, 6); MD5_STEP(MD5_I,d,a,b,c,x[15],0xfe2ce6e0,10);
+    MD5_STEP(MD5_I,c,d,a,b,x[ 6],0xa3014314,15); MD5_STEP(MD5_I,b,c,d,a,x[13],0x4e0811a1,21);
+    MD5_STEP(MD5_I,a,b,c,d,x[ 4],0xf7537e82, 6); MD5_STEP(MD5_I,d,a,b,c,x[11],0xbd3af235,10);
+    MD5_STEP(MD5_I,c,d,a,b,x[ 2],0x2ad7d2bb,15); MD5_STEP(MD5_I,b,c,d,a,x[ 9],0xeb86d391,21);
+
+    st[0] = (st[0] + a) & 0xffffffff;
+    st[1] = (st[1] + b) & 0xffffffff;
+    st[2] = (st[2] + c) & 0xffffffff;
+    st[3] = (st[3] + d) & 0xffffffff;
+}
+
+void mc_md5(const unsigned char *data, size_t len, unsigned char digest[16]){
+    md5_word st[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    unsigned char tail[128];
+    size_t i, ntail, bits;
+
+    for (i = 0; i + 64 <= len; i += 64)
+	md5_block(st, data + i);
+
+    /* Pad with 0x80, zeros, and the length in bits */
+    ntail = len - i;
+    memcpy(tail, data + i, ntail);
+    tail[ntail++] = 0x80;
+    while (ntail % 64 != 56) tail[ntail++] = 0;
+    bits = len * 8;
+    for (i = 0; i < 8; i++, bits >>= 8)
+	tail[ntail++] = (unsigned char)(bits & 0xff);
+
+    for (i = 0; i < ntail; i += 64)
+	md5_block(st, tail + i);
+
+    for (i = 0; i < 16; i++)
+	digest[i] = (unsigned char)((st[i/4] >> ((i%4)*8)) & 0xff);
+}
+
+/*
+ * Native key hashes, selectable by name with mcHashfun(). Each returns
+ * 32 bits which hash_servers() reduces to a server.
+ */
+
+/* First 4 bytes of the md5 digest, as libmemcached's "md5" */
+unsigned int mc_hash_md5(const char *key, size_t len){
+    unsigned char digest[16];
+
+    mc_md5((const unsigned char *)key, len, digest);
+    return ((unsigned int)digest[3] << 24) | ((unsigned int)digest[2] << 16) |
+	((unsigned int)digest[1] << 8) | digest[0];
+}
+
+static unsigned int crc32_table[256];
+
+/* The usual IEEE 802.3 crc32, as used by zlib, folded to 15 bits as
+ * libmemcached, PHP's memcache and python-memcached do.
+ */
+unsigned int mc_hash_crc32(const char *key, size_t len){
+    unsigned int crc = 0xffffffff;
+    size_t i;
+    int j;
+
+    if (crc32_table[1] == 0){
+	for (i = 0; i < 256; i++){
+	    crc = (unsigned int)i;
+	    for (j = 0; j < 8; j++)
+		crc = (crc & 1)? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+	    crc32_table[i] = crc;
+	}
+	crc = 0xffffffff;
+    }
+
+    for (i = 0; i < len; i++)
+	crc = crc32_table[(crc ^ (unsigned char)key[i]) & 0xff] ^ (crc >> 8);
+    crc = ~crc & 0xffffffff;
+
+    return (crc >> 16) & 0x7fff;
+}
+
+unsigned int mc_hash_fnv1a_32(const char *key, size_t len){
+    unsigned int h = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < len; i++){
+	h ^= (unsigned char)key[i];
+	h = (h * 16777619U) & 0xffffffff;
+    }
+    return h;
+}
+
+/* MurmurHash3_x86_32 with a seed of 0 */
+#define ROTL32(x,r) ((((x) << (r)) | ((x) >> (32 - (r)))) & 0xffffffff)
+
+unsigned int mc_hash_murmur3(const char *key, size_t len){
+    const unsigned char *data = (const unsigned char *)key;
+    const unsigned int c1 = 0xcc9e2d51, c2 = 0x1b873593;
+    unsigned int h = 0, k;
+    size_t i, nblocks = len / 4;
+
+    for (i = 0; i < nblocks; i++){
+	k = (unsigned int)data[i*4] | ((unsigned int)data[i*4+1] << 8) |
+	    ((unsigned int)data[i*4+2] << 16) | ((unsigned int)data[i*4+3] << 24);
+	k = (k * c1) & 0xffffffff;
+	k = ROTL32(k,15);
+	k = (k * c2) & 0xffffffff;
+	h ^= k;
+	h = ROTL32(h,13);
+	h = (h * 5 + 0xe6546b64) & 0xffffffff;
+    }
+
+    k = 0;
+    switch (len & 3){
+	case 3: k ^= (unsigned int)data[nblocks*4+2] << 16;
+		/* fall through */
+	case 2: k ^= (unsigned int)data[nblocks*4+1] << 8;
+		/* fall through */
+	case 1: k ^= data[nblocks*4];
+		k = (k * c1) & 0xffffffff;
+		k = ROTL32(k,15);
+		k = (k * c2) & 0xffffffff;
+		h ^= k;
+    }
+
+    h ^= (unsigned int)len;
+    h ^= h >> 16;
+    h = (h * 0x85ebca6b) & 0xffffffff;
+    h ^= h >> 13;
+    h = (h * 0xc2b2ae35) & 0xffffffff;
+    h ^= h >> 16;
+    return h;
+}
+
+/*
+ * XXH3_64bits with a seed of 0 and the default secret, of which the
+ * low 32 bits are returned.
+ */
+typedef unsigned long long xxh_u64;
+
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define XXH_SECRET_SIZE 192
+
+static const unsigned char xxh3_secret[XXH_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static unsigned int xxh_read32(const unsigned char *p){
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+	((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static xxh_u64 xxh_read64(const unsigned char *p){
+    return (xxh_u64)xxh_read32(p) | ((xxh_u64)xxh_read32(p + 4) << 32);
+}
+
+static xxh_u64 xxh_rotl64(xxh_u64 x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static xxh_u64 xxh_swap64(xxh_u64 x){
+    return ((x << 56) & 0xff00000000000000ULL) | ((x << 40) & 0x00ff000000000000ULL) |
+	((x << 24) & 0x0000ff0000000000ULL) | ((x << 8) & 0x000000ff00000000ULL) |
+	((x >> 8) & 0x00000000ff000000ULL) | ((x >> 24) & 0x0000000000ff0000ULL) |
+	((x >> 40) & 0x000000000000ff00ULL) | ((x >> 56) & 0x00000000000000ffULL);
+}
+
+/* 64x64->128 bit multiply, folding the high and low halves together */
+static xxh_u64 xxh_mul128_fold64(xxh_u64 a, xxh_u64 b){
+    xxh_u64 lo_lo = (a & 0xffffffff) * (b & 0xffffffff);
+    xxh_u64 hi_lo = (a >> 32) * (b & 0xffffffff);
+    xxh_u64 lo_hi = (a & 0xffffffff) * (b >> 32);
+    xxh_u64 hi_hi = (a >> 32) * (b >> 32);
+    xxh_u64 cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+    xxh_u64 upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    xxh_u64 lower = (cross << 32) | (lo_lo & 0xffffffff);
+    return lower ^ upper;
+}
+
+static xxh_u64 xxh64_avalanche(xxh_u64 h){
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static xxh_u64 xxh3_avalanche(xxh_u64 h){
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+static xxh_u64 xxh3_rrmxmx(xxh_u64 h, xxh_u64 len){
+    h ^= xxh_rotl64(h,49) ^ xxh_rotl64(h,24);
+    h *= 0x9FB21C651E98DF25ULL;
+    h ^= (h >> 35) + len;
+    h *= 0x9FB21C651E98DF25ULL;
+    return h ^ (h >> 28);
+}
+
+static xxh_u64 xxh3_mix16(const unsigned char *p, const unsigned char *s){
+    return xxh_mul128_fold64(xxh_read64(p) ^ xxh_read64(s),
+	    xxh_read64(p + 8) ^ xxh_read64(s + 8));
+}
+
+static void xxh3_accumulate_512(xxh_u64 *acc, const unsigned char *p, const unsigned char *s){
+    int i;
+    xxh_u64 data, key;
+
+    for (i = 0; i < 8; i++){
+	data = xxh_read64(p + 8*i);
+	key = data ^ xxh_read64(s + 8*i);
+	acc[i ^ 1] += data;
+	acc[i] += (key & 0xffffffff) * (key >> 32);
+    }
+}
+
+static void xxh3_scramble(xxh_u64 *acc, const unsigned char *s){
+    int i;
+
+    for (i = 0; i < 8; i++){
+	acc[i] ^= acc[i] >> 47;
+	acc[i] ^= xxh_read64(s + 8*i);
+	acc[i] *= XXH_PRIME32_1;
+    }
+}
+
+static xxh_u64 xxh3_long(const unsigned char *p, size_t len){
+    xxh_u64 acc[8] = { XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+	XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1 };
+    size_t nstripes_block = (XXH_SECRET_SIZE - 64) / 8;
+    size_t block_len = 64 * nstripes_block;
+    size_t nblocks = (len - 1) / block_len;
+    size_t n, i, nstripes;
+    xxh_u64 h;
+
+    for (n = 0; n < nblocks; n++){
+	for (i = 0; i < nstripes_block; i++)
+	    xxh3_accumulate_512(acc, p + n*block_len + i*64, xxh3_secret + i*8);
+	xxh3_scramble(acc, xxh3_secret + XXH_SECRET_SIZE - 64);
+    }
+
+    /* last partial block, then the last stripe */
+    nstripes = ((len - 1) - block_len*nblocks) / 64;
+    for (i = 0; i < nstripes; i++)
+	xxh3_accumulate_512(acc, p + nblocks*block_len + i*64, xxh3_secret + i*8);
+    xxh3_accumulate_512(acc, p + len - 64, xxh3_secret + XXH_SECRET_SIZE - 64 - 7);
+
+    /* merge accumulators */
+    h = len * XXH_PRIME64_1;
+    for (i = 0; i < 4; i++)
+	h += xxh_mul128_fold64(acc[2*i] ^ xxh_read64(xxh3_secret + 11 + 16*i),
+		acc[2*i+1] ^ xxh_read64(xxh3_secret + 11 + 16*i + 8));
+    return xxh3_avalanche(h);
+}
+
+static xxh_u64 xxh3_64(const unsigned char *p, size_t len){
+    const unsigned char *s = xxh3_secret;
+    xxh_u64 acc, lo, hi;
+    size_t i;
+
+    if (len == 0)
+	return xxh64_avalanche(xxh_read64(s + 56) ^ xxh_read64(s + 64));
+
+    if (len <= 3){
+	unsigned int combined = ((unsigned int)p[0] << 16) | ((unsigned int)p[len >> 1] << 24) |
+	    (unsigned int)p[len - 1] | ((unsigned int)len << 8);
+	return xxh64_avalanche((xxh_u64)combined ^ (xxh_u64)(xxh_read32(s) ^ xxh_read32(s + 4)));
+    }
+
+    if (len <= 8){
+	xxh_u64 in64 = xxh_read32(p + len - 4) + ((xxh_u64)xxh_read32(p) << 32);
+	return xxh3_rrmxmx(in64 ^ (xxh_read64(s + 8) ^ xxh_read64(s + 16)), len);
+    }
+
+    if (len <= 16){
+	lo = xxh_read64(p) ^ (xxh_read64(s + 24) ^ xxh_read64(s + 32));
+	hi = xxh_read64(p + len - 8) ^ (xxh_read64(s + 40) ^ xxh_read64(s + 48));
+	return xxh3_avalanche(len + xxh_swap64(lo) + hi + xxh_mul128_fold64(lo, hi));
+    }
+
+    if (len <= 128){
+	acc = len * XXH_PRIME64_1;
+	if (len > 32){
+	    if (len > 64){
+		if (len > 96){
+		    acc += xxh3_mix16(p + 48, s + 96);
+		    acc += xxh3_mix16(p + len - 64, s + 112);
+		}
+		acc += xxh3_mix16(p + 32, s + 64);
+		acc += xxh3_mix16(p + len - 48, s + 80);
+	    }
+	    acc += xxh3_mix16(p + 16, s + 32);
+	    acc += xxh3_mix16(p + len - 32, s + 48);
+	}
+	acc += xxh3_mix16(p, s);
+	acc += xxh3_mix16(p + len - 16, s + 16);
+	return xxh3_avalanche(acc);
+    }
+
+    if (len <= 240){
+	acc = len * XXH_PRIME64_1;
+	for (i = 0; i < 8; i++)
+	    acc += xxh3_mix16(p + 16*i, s + 16*i);
+	acc = xxh3_avalanche(acc);
+	for (i = 8; i < len / 16; i++)
+	    acc += xxh3_mix16(p + 16*i, s + 16*(i - 8) + 3);
+	acc += xxh3_mix16(p + len - 16, s + 136 - 17);
+	return xxh3_avalanche(acc);
+    }
+
+    return xxh3_long(p, len);
+}
+
+unsigned int mc_hash_xxh3(const char *key, size_t len){
+    return (unsigned int)(xxh3_64((const unsigned char *)key, len) & 0xffffffff);
+}
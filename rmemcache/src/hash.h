@@ -0,0 +1,7 @@
+/* hashes */
+void mc_md5(const unsigned char *data, size_t len, unsigned char digest[16]);
+unsigned int mc_hash_md5(const char *key, size_t len);
+unsigned int mc_hash_crc32(const char *key, size_t len);
+unsigned int mc_hash_fnv1a_32(const char *key, size_t len);
+unsigned int mc_hash_murmur3(const char *key, size_t len);
+unsigned int mc_hash_xxh3(const char *key, size_t len);
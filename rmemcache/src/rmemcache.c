@@ -1,20 +1,40 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <setjmp.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#ifdef Win32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
 
 #include <R.h>
 #include <Rinternals.h>
 #include <R_ext/Callbacks.h>
 #include <R_ext/Rdynload.h>
+#include "config.h"
 #include "sock.h"
+#include "hash.h"
+
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+/* The I/O thread needs pthreads and the GCC atomic builtins */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_LIBPTHREAD) && defined(__GNUC__) && !defined(Win32)
+#define MC_IOTHREAD
+#include <pthread.h>
+#include <signal.h>
+#endif
 
 static SEXP MCCON_type_tag;
-
-typedef struct {
-    int scon;
-    int port;
-    char *host;
-} mc_srv;
+static SEXP MCASYNC_type_tag;
 
 typedef struct {
     unsigned char *buf;
@@ -24,20 +44,403 @@ typedef struct {
     size_t curpos;
 } mc_buf;
 
+/* A run of bytes in a server's obuf waiting to be written */
+typedef struct {
+    size_t pos;
+    size_t len;
+} mc_seg;
+
+typedef struct mc_srv mc_srv;
+typedef struct mc_async mc_async;
+typedef struct mc_io mc_io;
+
+/* Request status, also returned by the reply parsers */
+#define MC_IDLE    0
+#define MC_PENDING 1 /* parser needs more replies */
+#define MC_DONE    2
+#define MC_FAILED  3
+
+/* Where a chunk fetched for reassembly is copied to */
+typedef struct {
+    unsigned char *dst;
+    size_t len;
+    int got;
+} mc_chunkdst;
+
+/* A request in flight on one server. Commands for n keys are queued
+ * in the server's obuf, and parse consumes their replies from its ibuf,
+ * filling in result at the index keyidx[] of each key. Requests
+ * without a parser expect no replies.
+ */
+typedef struct {
+    int status;
+    int (*parse)(mc_srv *srv);
+    SEXP keys;
+    SEXP result;
+    int *keyidx;
+    int n;
+    int next; /* next key awaiting a reply */
+    size_t skip; /* bytes of a streamed reply still to discard */
+    mc_chunkdst *chunks; /* when fetching chunks, where each key's value goes */
+} mc_req;
+
+/* A server request of an mc_async, queued on the server in the order
+ * written until its replies are read.
+ */
+typedef struct mc_pending {
+    mc_async *async;
+    mc_req req;
+    struct mc_pending *next;
+} mc_pending;
+
+struct mc_srv {
+    int scon;
+    int port;   /* 0 for a Unix domain socket, */
+    char *host; /* host being its path */
+    mc_addr addr; /* host resolved, family 0 until it resolves */
+    double weight;
+    int connecting;
+    mc_buf *ibuf;
+    mc_buf *obuf;
+    mc_seg *segs;
+    int nsegs;
+    int maxsegs;
+    int curseg;    /* next segment to write */
+    size_t segoff; /* bytes of it already written */
+    mc_req req;
+    mc_pending *pending; /* asynchronous requests written, oldest first */
+    int npending;
+    mc_pending *reading; /* the one whose replies are being read */
+    int nwriting;  /* requests out with the I/O thread, which reads */
+    int io_failed; /* replies into ibuf meanwhile; set if one failed */
+    mc_buf *qbuf;  /* noreply commands batched in quiet mode, */
+    int nquiet;    /* for this many keys */
+    int errors;      /* requests failed in a row */
+    double retry_at; /* when a dead server is tried again, 0 if alive */
+    double backoff;  /* wait before the retry after that */
+    double deadline; /* when the request in flight times out */
+    int read_timeout;  /* milliseconds, for blocking reads and writes */
+    int write_timeout;
+    unsigned long long sent;     /* bytes, since metrics were reset */
+    unsigned long long received;
+    int timed;            /* time the phases of the request in flight */
+    int connected;        /* whether it had to connect */
+    double t_begin;       /* when the request or its connect began */
+    double t_ready;       /* when it was connected */
+    double t_written;     /* when its last byte was written, 0 before */
+    double t_first;       /* when its first reply byte came, 0 before */
+    double t_done;
+    double t_unserialize; /* seconds spent unserializing replies */
+};
+
 /* Default buffer sizes are expressed as a power of two */
 #define MC_DEFAULT_POW_TWO 12
 
+/* I/O buffers are handed out to servers per call from a pool kept on
+ * the connection, in power of two size classes from 2**MC_DEFAULT_POW_TWO
+ * to 2**MC_POOL_MAX_POW bytes. Buffers that grew past the largest class
+ * are shrunk back to it when returned, and at most MC_POOL_DEPTH buffers
+ * are kept per class.
+ */
+#define MC_POOL_MAX_POW 20
+#define MC_POOL_CLASSES (MC_POOL_MAX_POW - MC_DEFAULT_POW_TWO + 1)
+#define MC_POOL_DEPTH   16
+
+/* Max number of storage commands queued for a server before
+ * reading back their replies.
+ */
+#define MC_STORE_BATCH 512
+
+/* Max number of asynchronous requests written to a server before
+ * reading back the replies of all of them
+ */
+#define MC_ASYNC_DEPTH 256
+
+/* Jobs out with the I/O thread at once */
+#define MC_IO_RING 64
+
+/* Max number of segments handed to one writev() */
+#define MC_IOV_BATCH 64
+
+/* Values that serialize to more than this are not buffered whole but
+ * streamed to the server this many bytes at a time.
+ */
+#define MC_STREAM_CHUNK (1024 * 1024)
+
+/* Key distribution across servers */
+#define MC_DIST_MODULA 0 /* hash(key) % nservers */
+#define MC_DIST_KETAMA 1 /* consistent hashing */
+
+/* Wire protocol, chosen per connection */
+#define MC_PROTO_ASCII  0
+#define MC_PROTO_BINARY 1
+
+/* Binary protocol header, opcodes and response status */
+#define MC_BIN_REQ_MAGIC   0x80
+#define MC_BIN_RES_MAGIC   0x81
+#define MC_BIN_HDR_LEN     24
+#define MC_BIN_INCREMENT   0x05
+#define MC_BIN_DECREMENT   0x06
+#define MC_BIN_GETQ        0x09
+#define MC_BIN_NOOP        0x0a
+#define MC_BIN_STAT        0x10
+#define MC_BIN_SETQ        0x11
+#define MC_BIN_ADDQ        0x12
+#define MC_BIN_REPLACEQ    0x13
+#define MC_BIN_DELETEQ     0x14
+#define MC_BIN_KEY_ENOENT  0x0001
+#define MC_BIN_KEY_EEXISTS 0x0002
+#define MC_BIN_NOT_STORED  0x0005
+
+/* Value compression, applied to serialized values larger than the
+ * connection's threshold. The algorithm is recorded in the item flags.
+ */
+#define MC_COMPRESS_NONE 0
+#define MC_COMPRESS_LZ4  1
+#define MC_COMPRESS_ZSTD 2
+
+#define MC_FLAG_LZ4  0x10
+#define MC_FLAG_ZSTD 0x20
+
+/* Bytes handed to or taken from a (de)compressor at a time */
+#define MC_COMPRESS_CHUNK 65536
+
+/* Chunked storage. A value that serializes to more than the connection's
+ * chunk size is split into chunks of that size, stored under the keys
+ * "<key>:<id>:<i>" which hash_servers() spreads over the servers, and a
+ * manifest stored under key itself with MC_FLAG_CHUNKED that reads
+ * "<id> <nchunks> <chunk size> <size> <flags>". id is new with every
+ * store, so a get racing a store never mixes the chunks of two values.
+ */
+#define MC_FLAG_CHUNKED 0x40
+#define MC_MANIFEST_MAX 128
+
+/* Payload types, kept in the low bits of the item flags. Values are
+ * serialized with XDR unless the connection asks for native serialization
+ * or typed payloads, which store attribute-free raw vectors as their
+ * bytes, scalar strings as UTF-8 and double and integer vectors as
+ * little-endian arrays after an 8 byte header, so that they cost a
+ * memcpy() to read and other clients can read them too. Typed payloads
+ * are never compressed.
+ */
+#define MC_TYPE_MASK    0x0f
+#define MC_TYPE_XDR     0
+#define MC_TYPE_RAW     1
+#define MC_TYPE_STRING  2
+#define MC_TYPE_DOUBLE  3
+#define MC_TYPE_INTEGER 4
+#define MC_TYPE_NATIVE  5
+#define MC_TYPED_HEADER 8
+
+/* Points on the ketama continuum per server of average weight.
+ * Must be a multiple of 4, as each md5 digest yields 4 points.
+ */
+#define MC_KETAMA_POINTS 160
+
+typedef struct {
+    unsigned int value;
+    int index; /* server */
+} mc_point;
+
+/* Native key hashes. "default" is the ELF hash for modula and md5 for
+ * ketama, as before they could be chosen.
+ */
+static const struct {
+    const char *name;
+    unsigned int (*fun)(const char *key, size_t len);
+} mc_hashes[] = {
+    { "default", NULL },
+    { "md5", mc_hash_md5 },
+    { "crc32", mc_hash_crc32 },
+    { "fnv1a_32", mc_hash_fnv1a_32 },
+    { "murmur3", mc_hash_murmur3 },
+    { "xxh3", mc_hash_xxh3 },
+};
+#define MC_NHASHES (int)(sizeof(mc_hashes)/sizeof(mc_hashes[0]))
+
+/* Near cache. Values got through a connection can be kept in process,
+ * already unserialized, so that reading a hot key again costs neither a
+ * round trip nor R_Unserialize(). Entries are found by key in a hash
+ * table and kept on an LRU list, their values protected on R's precious
+ * list. Once the estimated size of the values passes the budget, the
+ * least recently used are evicted, and an entry older than ttl counts
+ * as a miss. Stores, deletes and counter updates through the connection
+ * drop the entries of their keys, and count as an invalidation, after
+ * which gets still outstanding don't fill the near cache.
+ */
+typedef struct mc_near_entry mc_near_entry;
+struct mc_near_entry {
+    char *key;
+    unsigned int hash;
+    SEXP value;
+    size_t size;
+    double expires;             /* 0 for never */
+    mc_near_entry *chain;       /* next in bucket */
+    mc_near_entry *prev, *next; /* LRU list, most recently used first */
+};
+
+typedef struct {
+    size_t budget;  /* bytes, 0 when off */
+    double ttl;     /* seconds, 0 for no limit */
+    size_t size;
+    int count;
+    int nbuckets;   /* a power of two */
+    mc_near_entry **buckets;
+    mc_near_entry *head, *tail;
+    unsigned long hits, misses, evictions;
+    unsigned long invalidations; /* drops and clears so far */
+} mc_near;
+
+/* Latency histogram with log-spaced buckets, HDR style: values below
+ * MC_HIST_SUB nanoseconds get a bucket each, and each power of two
+ * above is split into MC_HIST_SUB buckets, so a value is known to
+ * within 1/MC_HIST_SUB of itself.
+ */
+#define MC_HIST_SUB_BITS 3
+#define MC_HIST_SUB      (1 << MC_HIST_SUB_BITS)
+#define MC_HIST_BUCKETS  ((64 - MC_HIST_SUB_BITS + 1) * MC_HIST_SUB)
+
+typedef struct {
+    unsigned long long count[MC_HIST_BUCKETS];
+    unsigned long long n;
+    double sum;  /* nanoseconds */
+    double max;
+} mc_hist;
+
+/* Operations, and the phases of their requests, timed when metrics
+ * are on
+ */
+#define MC_OP_STORE   0
+#define MC_OP_GET     1
+#define MC_OP_DELETE  2
+#define MC_OP_COUNTER 3
+#define MC_NOPS       4
+
+#define MC_PHASE_CONNECT     0
+#define MC_PHASE_SERIALIZE   1
+#define MC_PHASE_WRITE       2
+#define MC_PHASE_WAIT        3 /* for the first byte of the reply */
+#define MC_PHASE_READ        4
+#define MC_PHASE_UNSERIALIZE 5
+#define MC_NPHASES           6
+
+static const char *mc_op_names[MC_NOPS] = { "store", "get", "delete", "counter" };
+static const char *mc_phase_names[MC_NPHASES] = {
+    "connect", "serialize", "write", "wait", "read", "unserialize"
+};
+
+typedef struct {
+    int op; /* MC_OP_* being timed, -1 for none */
+    unsigned long long calls[MC_NOPS];
+    unsigned long long keys[MC_NOPS];
+    unsigned long long errors[MC_NOPS]; /* server requests that failed */
+    mc_hist latency[MC_NOPS];
+    mc_hist phase[MC_NOPS][MC_NPHASES];
+} mc_meter;
+
 typedef struct {
     int nservers;
     mc_srv **servers;
-    int threshold;
+    int threshold; /* compress values larger than this, 0 for never */
+    int compress;  /* MC_COMPRESS_* */
+    int chunksize; /* chunk values larger than this, 0 for never */
+    int typed;     /* store typed payloads where possible */
+    int native;    /* serialize in native rather than XDR format */
     SEXP hashfun;
-    mc_buf *ibuf;
-    mc_buf *obuf;
+    int hash; /* index into mc_hashes */
+    int distribution;
+    int protocol;
+    mc_point *continuum; /* sorted by value */
+    int npoints;
+    mc_buf *pool[MC_POOL_CLASSES][MC_POOL_DEPTH]; /* free I/O buffers */
+    int npooled[MC_POOL_CLASSES];
+    size_t ibuf_hwm; /* largest ibuf and obuf used so far */
+    size_t obuf_hwm;
+    mc_buf *sbuf; /* scratch for values being chunked */
+    mc_near near;
+    int failure_limit;    /* failed requests marking a server dead, 0 for never */
+    double retry_timeout; /* first wait before retrying a dead server */
+    double retry_max;     /* longest wait, the wait doubling with each failed retry */
+    int rehash;           /* hash keys of dead servers to live ones */
+    int replicas;         /* copies kept of each key, 0 or 1 for one */
+    mc_sockopts sockopts;
+    double connect_timeout; /* seconds a server may take to accept, */
+    double read_timeout;    /* to send any reply bytes */
+    double write_timeout;   /* and to take any request bytes */
+    int metrics_on;
+    mc_meter *metrics;    /* NULL when off */
+    int io_on;
+    mc_io *io;            /* NULL when off */
+    int quiet_batch;      /* bytes of noreply commands batched per server, 0 for none */
 } mc_con;
 
+/* An asynchronous get or store, whose commands were written to the
+ * servers when it was issued and whose replies are read when it's
+ * waited on, or before anything else is done on the connection. data
+ * holds the connection, keys and results, and is kept from the garbage
+ * collector until every reply has been read, even if the handle isn't.
+ */
+struct mc_async {
+    int get;      /* else a store */
+    int nkeys;    /* keys given, before replication */
+    int nrep;     /* copies stored of each */
+    int npending; /* server requests whose replies are unread */
+    int failed;   /* server requests that failed */
+    int orphaned; /* the handle was garbage collected first */
+    unsigned long invalidations; /* of the near cache, when a get began */
+    SEXP data;
+};
+
+/* Slots of mc_async.data */
+#define MC_ASYNC_CON    0
+#define MC_ASYNC_KEYS   1 /* replicated for a store */
+#define MC_ASYNC_RESULT 2 /* per copy for a store */
+#define MC_ASYNC_VALUES 3 /* for a store */
+#define MC_ASYNC_EXP    4
+#define MC_ASYNC_CMD    5
+#define MC_ASYNC_APART  6 /* keys whose values are stored when collected */
+#define MC_ASYNC_NEAR   7 /* for a get, whether each key came from the near cache */
+#define MC_ASYNC_VALUE  8 /* what mcCollect() returns, once collected */
+#define MC_ASYNC_SLOTS  9
+
+/* Connection options set by mc_options(), by name */
+#define MC_OPT_COUNT   0 /* non-negative int */
+#define MC_OPT_SECONDS 1 /* non-negative double */
+#define MC_OPT_BOOL    2 /* int, TRUE or FALSE */
+#define MC_OPT_TIMEOUT 3 /* double, at least a millisecond */
+
+static const struct {
+    const char *name;
+    int type;
+    size_t offset;
+} mc_options_tab[] = {
+    { "failureLimit", MC_OPT_COUNT, offsetof(mc_con,failure_limit) },
+    { "retryTimeout", MC_OPT_SECONDS, offsetof(mc_con,retry_timeout) },
+    { "retryMaxTimeout", MC_OPT_SECONDS, offsetof(mc_con,retry_max) },
+    { "rehash", MC_OPT_BOOL, offsetof(mc_con,rehash) },
+    { "replicas", MC_OPT_COUNT, offsetof(mc_con,replicas) },
+    { "metrics", MC_OPT_BOOL, offsetof(mc_con,metrics_on) },
+    { "ioThread", MC_OPT_BOOL, offsetof(mc_con,io_on) },
+    { "quietBatch", MC_OPT_COUNT, offsetof(mc_con,quiet_batch) },
+    { "keepalive", MC_OPT_BOOL, offsetof(mc_con,sockopts.keepalive) },
+    { "nodelay", MC_OPT_BOOL, offsetof(mc_con,sockopts.nodelay) },
+    { "sendBuffer", MC_OPT_COUNT, offsetof(mc_con,sockopts.sndbuf) },
+    { "receiveBuffer", MC_OPT_COUNT, offsetof(mc_con,sockopts.rcvbuf) },
+    { "connectTimeout", MC_OPT_TIMEOUT, offsetof(mc_con,connect_timeout) },
+    { "readTimeout", MC_OPT_TIMEOUT, offsetof(mc_con,read_timeout) },
+    { "writeTimeout", MC_OPT_TIMEOUT, offsetof(mc_con,write_timeout) },
+};
+#define MC_NOPTIONS (int)(sizeof(mc_options_tab)/sizeof(mc_options_tab[0]))
+
 /* Prototypes */
 SEXP mc_hashfun(SEXP mcon_s, SEXP hashfun);
+static void resize_buf(mc_buf *buf, size_t needed);
+static void queue_seg(mc_srv *srv, size_t pos, size_t len);
+static void queue_cmd(mc_srv *srv, size_t pos);
+static void clear_near(mc_con *mcon);
+static void io_reap(mc_con *mcon, int max);
+static void sync_io(mc_con *mcon);
+static int flush_quiet(mc_con *mcon, size_t min);
 
 static mc_con *unmarshall_con(SEXP mcon_s){
     mc_con *mcon;
@@ -51,43 +454,276 @@ static mc_con *unmarshall_con(SEXP mcon_s){
 	error("rmemcache: SEXP not an mcon");
 	return NULL;
     }
+    /* No op is being timed on entry, even if an error cut the last short */
+    if (mcon->metrics) mcon->metrics->op = -1;
     return mcon;
 }
 
+/* Seconds on a clock that doesn't jump with the time of day */
+static double monotonic_time(void){
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC,&ts) == 0)
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+    return (double)time(NULL);
+}
+
+/* Converts a timeout in seconds to the milliseconds the socket layer
+ * takes, rounding up to at least one.
+ */
+static int timeout_ms(double seconds){
+    double ms = seconds * 1000 + 0.999;
+    if (ms < 1) return 1;
+    if (ms > INT_MAX) return INT_MAX;
+    return (int)ms;
+}
+
+/* Records a latency of seconds in hist */
+static void hist_record(mc_hist *hist, double seconds){
+    unsigned long long ns = (seconds > 0)? (unsigned long long)(seconds * 1e9) : 0;
+    int e, b;
+
+    if (ns < MC_HIST_SUB){
+	b = (int)ns;
+    } else {
+#ifdef __GNUC__
+	e = 63 - __builtin_clzll(ns);
+#else
+	for (e = 0; ns >> (e + 1); e++);
+#endif
+	b = (e - MC_HIST_SUB_BITS + 1) * MC_HIST_SUB +
+	    (int)((ns >> (e - MC_HIST_SUB_BITS)) & (MC_HIST_SUB - 1));
+    }
+    hist->count[b]++;
+    hist->n++;
+    hist->sum += (double)ns;
+    if (ns > hist->max) hist->max = (double)ns;
+}
+
+/* Returns the q'th quantile in hist, in seconds: the middle of the
+ * bucket it falls in.
+ */
+static double hist_quantile(mc_hist *hist, double q){
+    unsigned long long seen = 0, rank;
+    double low, width;
+    int b, e;
+
+    if (hist->n == 0) return NA_REAL;
+    rank = (unsigned long long)(q * hist->n);
+    if (rank >= hist->n) rank = hist->n - 1;
+    for (b = 0; b < MC_HIST_BUCKETS - 1; b++)
+	if ((seen += hist->count[b]) > rank) break;
+
+    if (b < MC_HIST_SUB) return b * 1e-9;
+    e = b / MC_HIST_SUB + MC_HIST_SUB_BITS - 1;
+    width = ldexp(1.0,e - MC_HIST_SUB_BITS);
+    low = ldexp(1.0,e) + (b % MC_HIST_SUB) * width;
+    return (low + width / 2) * 1e-9;
+}
+
+/* Allocates or frees mcon->metrics as the metrics option says */
+static void sync_metrics(mc_con *mcon){
+    if (mcon->metrics_on && mcon->metrics == NULL){
+	if ((mcon->metrics = calloc(1,sizeof(mc_meter))) != NULL)
+	    mcon->metrics->op = -1;
+    } else if (!mcon->metrics_on && mcon->metrics != NULL){
+	free(mcon->metrics);
+	mcon->metrics = NULL;
+    }
+}
+
+/* Starts timing op. Returns when it started, or 0 if metrics are off
+ * or another op is being timed, as when a store deletes the chunks of a
+ * value it failed to store, in which case the outer op is charged.
+ */
+static double metrics_begin(mc_con *mcon, int op){
+    if (mcon->metrics == NULL || mcon->metrics->op != -1) return 0;
+    mcon->metrics->op = op;
+    return monotonic_time();
+}
+
+static void metrics_end(mc_con *mcon, double start, int nkeys){
+    mc_meter *m = mcon->metrics;
+
+    if (m == NULL || start == 0) return;
+    m->calls[m->op]++;
+    m->keys[m->op] += nkeys;
+    hist_record(&m->latency[m->op],monotonic_time() - start);
+    m->op = -1;
+}
+
+/* Records the time spent in phase of the op being timed */
+static void metrics_phase(mc_con *mcon, int phase, double seconds){
+    if (mcon->metrics && mcon->metrics->op != -1)
+	hist_record(&mcon->metrics->phase[mcon->metrics->op][phase],seconds);
+}
+
+/* Records the phases of the request srv just ran */
+static void metrics_request(mc_con *mcon, mc_srv *srv){
+    double start;
+
+    if (!srv->timed) return;
+    srv->timed = FALSE;
+    if (srv->req.status == MC_FAILED){
+	if (mcon->metrics && mcon->metrics->op != -1)
+	    mcon->metrics->errors[mcon->metrics->op]++;
+	return;
+    }
+    if (srv->connected) metrics_phase(mcon,MC_PHASE_CONNECT,srv->t_ready - srv->t_begin);
+    if (srv->t_written == 0) return;
+    metrics_phase(mcon,MC_PHASE_WRITE,srv->t_written - srv->t_ready);
+    if (srv->t_first == 0) return;
+    start = srv->t_written;
+    if (srv->t_first > start){
+	metrics_phase(mcon,MC_PHASE_WAIT,srv->t_first - start);
+	start = srv->t_first;
+    } else {
+	metrics_phase(mcon,MC_PHASE_WAIT,0);
+    }
+    metrics_phase(mcon,MC_PHASE_READ,srv->t_done - start - srv->t_unserialize);
+    if (srv->t_unserialize > 0)
+	metrics_phase(mcon,MC_PHASE_UNSERIALIZE,srv->t_unserialize);
+}
+
+/* Frees p, whose replies were read or, if !ok, lost. Its async is
+ * let go once all of its requests are finished, and freed if it was
+ * orphaned.
+ */
+static void finish_pending(mc_pending *p, int ok){
+    mc_async *async = p->async;
+
+    if (!ok) async->failed++;
+    free(p->req.keyidx);
+    free(p);
+    if (--async->npending > 0) return;
+    R_ReleaseObject(async->data);
+    if (async->orphaned) free(async);
+}
+
+/* Drop the connection to srv, e.g. after a network or protocol error
+ * leaves the stream in an unknown state. The next command reconnects.
+ */
+static void close_srv(mc_srv *srv){
+    mc_pending *p;
+
+    if (srv->scon != -1) mc_SockClose(srv->scon);
+    srv->scon = -1;
+    srv->connecting = 0;
+
+    /* The replies to asynchronous requests went with the connection */
+    while ((p = srv->pending) != NULL){
+	srv->pending = p->next;
+	finish_pending(p,FALSE);
+    }
+    srv->npending = 0;
+}
+
+/* Formats srv the way it's given in a server list into name, which
+ * must hold strlen(srv->host) + 16 bytes.
+ */
+static char *server_name(mc_srv *srv, char *name){
+    if (srv->port == 0)
+	sprintf(name,"unix:%s",srv->host);
+    else if (strchr(srv->host,':'))
+	sprintf(name,"[%s]:%d",srv->host,srv->port);
+    else
+	sprintf(name,"%s:%d",srv->host,srv->port);
+    return name;
+}
+
+/* Failure detection. A server whose requests fail failure_limit times
+ * in a row is marked dead: requests to it fail at once, without waiting
+ * on a connect, until retry_at. The request after that is let through,
+ * and if it fails too, the server stays dead for twice as long, up to
+ * retry_max. Any request that succeeds makes it live again.
+ */
+static int server_dead(mc_srv *srv){
+    return srv->retry_at > 0 && monotonic_time() < srv->retry_at;
+}
+
+static void server_failed(mc_con *mcon, mc_srv *srv){
+    srv->errors++;
+    if (mcon->failure_limit == 0 || srv->errors < mcon->failure_limit) return;
+
+    if (srv->retry_at == 0){
+	srv->backoff = mcon->retry_timeout;
+	warning("rmemcache: server %s marked dead after %d errors",
+		server_name(srv,R_alloc(strlen(srv->host) + 16,1)),srv->errors);
+    }
+    srv->retry_at = monotonic_time() + srv->backoff;
+    srv->backoff *= 2;
+    if (srv->backoff > mcon->retry_max) srv->backoff = mcon->retry_max;
+}
+
+static void server_ok(mc_srv *srv){
+    srv->errors = 0;
+    srv->retry_at = 0;
+    srv->backoff = 0;
+}
+
 static int close_sockets(mc_con *mcon){
+    io_reap(mcon,0);
     if (mcon->servers != NULL) {
 	int i;
 	for (i=0;i<mcon->nservers;i++){
-	    if (mcon->servers[i]->scon != -1) mc_SockClose(mcon->servers[i]->scon);
+	    close_srv(mcon->servers[i]);
 	}
     }
     return TRUE;
 }
 
+static void destroy_buf(mc_buf **buf){
+    if (*buf) {
+	if ((*buf)->buf) free((*buf)->buf);
+	free(*buf);
+	*buf = NULL;
+    }
+}
+
+/* Frees the servers' buffers and everything in the pool */
+static void destroy_iobufs( mc_con *mcon){
+    int c;
+
+    if (mcon == NULL) return;
+    io_reap(mcon,0);
+    if (mcon->servers != NULL) {
+	int i;
+	for (i=0;i<mcon->nservers;i++){
+	    mc_srv *srv = mcon->servers[i];
+	    destroy_buf(&srv->obuf);
+	    if (srv->pending == NULL) destroy_buf(&srv->ibuf);
+	    if (srv->segs) free(srv->segs);
+	    srv->segs = NULL;
+	    srv->nsegs = srv->maxsegs = 0;
+	}
+    }
+    destroy_buf(&mcon->sbuf);
+    for (c = 0; c < MC_POOL_CLASSES; c++)
+	while (mcon->npooled[c] > 0)
+	    destroy_buf(&mcon->pool[c][--mcon->npooled[c]]);
+}
+
 static void destroy_srvlist(mc_con *mcon){
     if (mcon->servers != NULL) {
 	close_sockets(mcon);
+	destroy_iobufs(mcon);
 	int i;
 	for (i=0;i<mcon->nservers;i++){
+	    if (mcon->servers[i]->reading)
+		finish_pending(mcon->servers[i]->reading,FALSE);
+	    destroy_buf(&mcon->servers[i]->qbuf);
+	    free(mcon->servers[i]->host);
 	    free(mcon->servers[i]);
 	}
 	free(mcon->servers);
+	mcon->servers = NULL;
 	mcon->nservers=0;
     }
-}
-
-static void destroy_iobufs( mc_con *mcon){
-    if (mcon != NULL) {
-	if (mcon->obuf) {
-	    if (mcon->obuf->buf) free(mcon->obuf->buf);
-	    free(mcon->obuf);
-	    mcon->obuf = NULL;
-	}
-	if (mcon->ibuf) {
-	    if (mcon->ibuf->buf) free(mcon->ibuf->buf);
-	    free(mcon->ibuf);
-	    mcon->ibuf = NULL;
-	}
+    if (mcon->continuum != NULL) {
+	free(mcon->continuum);
+	mcon->continuum = NULL;
+	mcon->npoints = 0;
     }
 }
 
@@ -101,50 +737,283 @@ void mc_finalize_con(SEXP mcon_s){
     mc_con *mcon = unmarshall_con(mcon_s);
     if (mcon == NULL) return;
 
+    mcon->io_on = FALSE;
+    sync_io(mcon);
     destroy_srvlist(mcon);
+    clear_near(mcon);
     if (mcon->hashfun) R_ReleaseObject(mcon->hashfun);
-    destroy_iobufs(mcon);
+    free(mcon->metrics);
     free(mcon);
 }
 
-static int populate_srvlist(mc_con **p_mcon,SEXP srvlist){
+static int point_cmp(const void *a, const void *b){
+    unsigned int x = ((const mc_point *)a)->value;
+    unsigned int y = ((const mc_point *)b)->value;
+    return (x < y)? -1 : (x > y)? 1 : 0;
+}
+
+/* The 4 byte hash value at offset h*4 of an md5 digest */
+static unsigned int ketama_hash(const unsigned char *digest, int h){
+    return ((unsigned int)digest[3+h*4] << 24) |
+	((unsigned int)digest[2+h*4] << 16) |
+	((unsigned int)digest[1+h*4] << 8) |
+	digest[h*4];
+}
+
+/* Builds the ketama continuum, compatible with libketama: each server
+ * gets a number of points on a circle of 2^32 hash values in proportion
+ * to its weight, 4 per md5 digest of "<host>:<port>-<n>". A key maps to
+ * the server owning the first point at or after the key's hash.
+ * Adding or removing a server thus only remaps the keys whose points
+ * it takes over or gives up.
+ */
+static int build_continuum(mc_con *mcon){
+    int i, j, k, ndigests;
+    size_t len, maxlen = 0;
+    double totalweight = 0;
+    char *ident;
+    unsigned char digest[16];
+    mc_srv *srv;
+
+    if (mcon->continuum) free(mcon->continuum);
+    mcon->continuum = NULL;
+    mcon->npoints = 0;
+
+    if (mcon->distribution != MC_DIST_KETAMA || mcon->nservers == 0)
+	return TRUE;
+
+    for (i = 0; i < mcon->nservers; i++){
+	totalweight += mcon->servers[i]->weight;
+	len = strlen(mcon->servers[i]->host);
+	if (len > maxlen) maxlen = len;
+    }
+    if (totalweight <= 0){
+	warning("rmemcache: server weights must not all be zero!");
+	return FALSE;
+    }
+
+    mcon->continuum = calloc(MC_KETAMA_POINTS * mcon->nservers + 4 * mcon->nservers,
+	    sizeof(mc_point));
+    if (mcon->continuum == NULL) return FALSE;
+
+    ident = malloc(maxlen + 32);
+    if (ident == NULL){
+	free(mcon->continuum);
+	mcon->continuum = NULL;
+	return FALSE;
+    }
+
+    for (i = 0; i < mcon->nservers; i++){
+	srv = mcon->servers[i];
+	ndigests = (int)(srv->weight / totalweight * MC_KETAMA_POINTS / 4 *
+		mcon->nservers + 1e-10);
+
+	for (j = 0; j < ndigests; j++){
+	    sprintf(ident,"%s:%d-%d",srv->host,srv->port,j);
+	    mc_md5((unsigned char *)ident,strlen(ident),digest);
+	    for (k = 0; k < 4; k++){
+		mcon->continuum[mcon->npoints].value = ketama_hash(digest,k);
+		mcon->continuum[mcon->npoints].index = i;
+		mcon->npoints++;
+	    }
+	}
+    }
+    free(ident);
+
+    qsort(mcon->continuum,mcon->npoints,sizeof(mc_point),point_cmp);
+
+    return TRUE;
+}
+
+/* Returns the index of the first point of the continuum at or after
+ * key's hash. crc32 only yields 15 bits, which would put nearly every
+ * key before the first point, so it keeps md5 here: it is a hash for
+ * modula distribution.
+ */
+static int ketama_point(mc_con *mcon, const char *key){
+    unsigned char digest[16];
+    unsigned int h;
+    int lo = 0, hi = mcon->npoints, mid;
+
+    if (mc_hashes[mcon->hash].fun &&
+	    mc_hashes[mcon->hash].fun != mc_hash_crc32){
+	h = mc_hashes[mcon->hash].fun(key,strlen(key));
+    } else {
+	mc_md5((const unsigned char *)key,strlen(key),digest);
+	h = ketama_hash(digest,0);
+    }
+
+    /* Binary search for the first point >= h */
+    while (lo < hi){
+	mid = lo + (hi - lo) / 2;
+	if (mcon->continuum[mid].value < h)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo == mcon->npoints) lo = 0; /* wrap around the circle */
+
+    return lo;
+}
+
+/* 0 based indexing, or -1 if the continuum is empty */
+static int ketama_server(mc_con *mcon, const char *key){
+    if (mcon->npoints == 0) return -1;
+    return mcon->continuum[ketama_point(mcon,key)].index;
+}
+
+/* Returns a live server for key, whose server i is dead: the next one
+ * on the continuum with ketama, which moves no other keys, or one of the
+ * live servers picked by the key's hash otherwise. Returns i if all are
+ * dead.
+ */
+static int rehash_server(mc_con *mcon, const char *key, int i){
+    int j, n, p, nlive = 0;
+
+    if (mcon->distribution == MC_DIST_KETAMA && !mcon->hashfun){
+	p = ketama_point(mcon,key);
+	for (n = 1; n < mcon->npoints; n++){
+	    p = (p + 1) % mcon->npoints;
+	    if (!server_dead(mcon->servers[mcon->continuum[p].index]))
+		return mcon->continuum[p].index;
+	}
+	return i;
+    }
+
+    for (j = 0; j < mcon->nservers; j++)
+	if (!server_dead(mcon->servers[j])) nlive++;
+    if (nlive == 0) return i;
+
+    n = mc_hash_fnv1a_32(key,strlen(key)) % nlive;
+    for (j = 0; j < mcon->nservers; j++)
+	if (!server_dead(mcon->servers[j]) && n-- == 0) return j;
+    return i;
+}
+
+/* Returns MC_DIST_* for "modula" or "ketama", or -1 */
+static int parse_distribution(SEXP distribution){
+    const char *dist;
+
+    if (!isString(distribution) || LENGTH(distribution) != 1) return -1;
+
+    dist = CHAR(STRING_ELT(distribution,0));
+    if (strcmp(dist,"modula") == 0) return MC_DIST_MODULA;
+    if (strcmp(dist,"ketama") == 0) return MC_DIST_KETAMA;
+    return -1;
+}
+
+static int parse_protocol(SEXP protocol){
+    const char *proto;
+
+    if (!isString(protocol) || LENGTH(protocol) != 1) return -1;
+
+    proto = CHAR(STRING_ELT(protocol,0));
+    if (strcmp(proto,"ascii") == 0) return MC_PROTO_ASCII;
+    if (strcmp(proto,"binary") == 0) return MC_PROTO_BINARY;
+    return -1;
+}
+
+/* Returns the ':' before the port in "host:port" or "[IPv6]:port", or
+ * NULL if there isn't one. Unix domain sockets, "unix:path", have none.
+ */
+static char *port_separator(const char *server){
+    const char *bracket;
+
+    if (server[0] == '['){
+	bracket = strchr(server,']');
+	return (bracket && bracket[1] == ':')? (char *)bracket + 1 : NULL;
+    }
+    return strchr(server,':');
+}
+
+/* Resolves srv->addr if it isn't already, so that a host that couldn't
+ * be resolved when the server list was set is tried again on connect.
+ */
+static int resolve_srv(mc_srv *srv){
+    if (srv->addr.family != 0) return TRUE;
+    if (srv->port == 0)
+	return mc_SockUnixAddr(srv->host,&srv->addr) == 0;
+    return mc_SockResolve(srv->host,srv->port,&srv->addr) == 0;
+}
+
+/* weights may be NULL, giving every server a weight of 1. They only
+ * matter for the ketama distribution.
+ */
+static int populate_srvlist(mc_con **p_mcon,SEXP srvlist,SEXP weights){
     mc_con *mcon = *p_mcon;
     mc_srv *srv;
     int i, nservers;
     char *colon;
-    char *ip, *port;
 
     if (!isString(srvlist)){
 	warning("rmemcache: server list must be a character vector!");
 	return FALSE;
     }
 
+    if (!isNull(weights)){
+	if (!isReal(weights) || LENGTH(weights) != LENGTH(srvlist)){
+	    warning("rmemcache: weights must be a numeric vector, one per server!");
+	    return FALSE;
+	}
+	for (i = 0; i < LENGTH(weights); i++){
+	    if (!(REAL(weights)[i] >= 0)){
+		warning("rmemcache: weights must not be negative!");
+		return FALSE;
+	    }
+	}
+    }
+
     /* First pass thru list to see if all servers pass muster
      * just checking for ip/dns and port
      */
     nservers = LENGTH(srvlist);
     for (i = 0; i < nservers; i++){
-	colon = strchr(CHAR(STRING_PTR(srvlist)[i]),':');
+	if (strncmp(CHAR(STRING_PTR(srvlist)[i]),"unix:",5) == 0){
+	    if (CHAR(STRING_PTR(srvlist)[i])[5] == '\0'){
+		warning("rmemcache: unix: must be followed by a socket path");
+		return FALSE;
+	    }
+	    continue;
+	}
+	colon = port_separator(CHAR(STRING_PTR(srvlist)[i]));
 	if (colon == NULL){
 	    warning("rmemcache: server and port must be separated by a ':'");
 	    return FALSE ;
 	}
+	if (atoi(colon+1) <= 0){
+	    warning("rmemcache: server port must be a positive number");
+	    return FALSE;
+	}
     }
 
-    /* Now really allocate the server list */
+    /* Now really allocate the server list, resolving each host once
+     * here rather than on every connect
+     */
     destroy_srvlist(mcon);
     mcon->servers = calloc(nservers,sizeof(mc_srv *));
     for (i = 0; i < nservers; i++){
-	mcon->servers[i] = calloc(1,sizeof(mc_srv));
-	mcon->servers[i]->host = strdup(CHAR(STRING_ELT(srvlist,i)));
-	colon = strchr(mcon->servers[i]->host,':');
-	mcon->servers[i]->port = atoi(colon+1);
-	*colon = '\0';
-	mcon->servers[i]->scon = -1; /* for not open; 0 is a valid socket */
+	srv = mcon->servers[i] = calloc(1,sizeof(mc_srv));
+	if (strncmp(CHAR(STRING_ELT(srvlist,i)),"unix:",5) == 0){
+	    srv->host = strdup(CHAR(STRING_ELT(srvlist,i)) + 5);
+	    srv->port = 0;
+	} else {
+	    srv->host = strdup(CHAR(STRING_ELT(srvlist,i)));
+	    colon = port_separator(srv->host);
+	    srv->port = atoi(colon+1);
+	    *colon = '\0';
+	    if (srv->host[0] == '['){ /* [IPv6 literal] */
+		memmove(srv->host,srv->host + 1,colon - srv->host - 2);
+		colon[-2] = '\0';
+	    }
+	}
+	srv->scon = -1; /* for not open; 0 is a valid socket */
+	srv->weight = isNull(weights)? 1 : REAL(weights)[i];
+	if (!resolve_srv(srv))
+	    warning("rmemcache: cannot resolve server %s",srv->host);
     }
     mcon->nservers = nservers;
 
-    return TRUE; /* success */
+    return build_continuum(mcon); /* success */
 }
 
 SEXP mc_print_con(SEXP mcon_s){
@@ -152,46 +1021,128 @@ SEXP mc_print_con(SEXP mcon_s){
 
     if (!mcon) return R_NilValue;
 
-    Rprintf("cmpthresh: %d\n",mcon->threshold);
+    io_reap(mcon,MC_IO_RING);
+
+    if (mcon->compress != MC_COMPRESS_NONE)
+	Rprintf("cmpthresh: %d (%s)\n",mcon->threshold,
+		(mcon->compress == MC_COMPRESS_LZ4)? "lz4" : "zstd");
+    else
+	Rprintf("cmpthresh: %d\n",mcon->threshold);
+    Rprintf("chunksize: %d\n",mcon->chunksize);
+    Rprintf("format: %s%s\n",(mcon->native)? "native" : "xdr",
+	    (mcon->typed)? ", typed" : "");
+    if (mcon->near.budget > 0){
+	Rprintf("nearcache: %d entries, %lu of %lu bytes",mcon->near.count,
+		(unsigned long)mcon->near.size,(unsigned long)mcon->near.budget);
+	if (mcon->near.ttl > 0) Rprintf(", ttl %gs",mcon->near.ttl);
+	Rprintf("\n");
+    }
+    if (mcon->near.budget > 0 || mcon->near.hits + mcon->near.misses > 0)
+	Rprintf("  hits: %lu misses: %lu evictions: %lu\n",mcon->near.hits,
+		mcon->near.misses,mcon->near.evictions);
     if (mcon->hashfun)
 	Rprintf("hashfun: user-provided\n");
     else 
-	Rprintf("hashfun: internal\n");
+	Rprintf("hashfun: %s\n",mc_hashes[mcon->hash].name);
+    if (mcon->distribution == MC_DIST_KETAMA)
+	Rprintf("distribution: ketama (%d points)\n",mcon->npoints);
+    else
+	Rprintf("distribution: modula\n");
+    Rprintf("protocol: %s\n",(mcon->protocol == MC_PROTO_BINARY)? "binary" : "ascii");
+    if (mcon->replicas > 1)
+	Rprintf("replicas: %d\n",mcon->replicas);
+    if (mcon->metrics)
+	Rprintf("metrics: on\n");
+    if (mcon->failure_limit > 0)
+	Rprintf("failure limit: %d, retry after %gs up to %gs%s\n",mcon->failure_limit,
+		mcon->retry_timeout,mcon->retry_max,(mcon->rehash)? ", rehash" : "");
+    Rprintf("socket: nodelay %s, keepalive %s",(mcon->sockopts.nodelay)? "on" : "off",
+	    (mcon->sockopts.keepalive)? "on" : "off");
+    if (mcon->sockopts.sndbuf > 0) Rprintf(", sndbuf %d",mcon->sockopts.sndbuf);
+    if (mcon->sockopts.rcvbuf > 0) Rprintf(", rcvbuf %d",mcon->sockopts.rcvbuf);
+    Rprintf("\n");
+    Rprintf("timeouts: connect %gs, read %gs, write %gs\n",mcon->connect_timeout,
+	    mcon->read_timeout,mcon->write_timeout);
+    {
+	int i, n = 0;
+	for (i = 0; i < mcon->nservers; i++) n += mcon->servers[i]->npending;
+	if (n > 0) Rprintf("async: %d requests awaiting replies\n",n);
+    }
+    if (mcon->io)
+	Rprintf("io thread: on\n");
+    if (mcon->quiet_batch > 0)
+	Rprintf("quiet batch: %d bytes\n",mcon->quiet_batch);
+    {
+	int c, nbufs = 0;
+	unsigned long bytes = 0;
+	for (c = 0; c < MC_POOL_CLASSES; c++){
+	    nbufs += mcon->npooled[c];
+	    bytes += (unsigned long)mcon->npooled[c] << (c + MC_DEFAULT_POW_TWO);
+	}
+	Rprintf("iobufs: %d pooled (%lu bytes)\n",nbufs,bytes);
+	Rprintf("  ibuf high water: %lu\n",(unsigned long)mcon->ibuf_hwm);
+	Rprintf("  obuf high water: %lu\n",(unsigned long)mcon->obuf_hwm);
+    }
 
     if (mcon->nservers){
 	int i =0;
 	for (i = 0; i < mcon->nservers; i++){
-	    Rprintf("server %d: %s %d\n",i+1,mcon->servers[i]->host,mcon->servers[i]->port);
+	    mc_srv *srv = mcon->servers[i];
+	    if (srv->port == 0)
+		Rprintf("server %d: unix:%s weight %g",i+1,srv->host,srv->weight);
+	    else
+		Rprintf("server %d: %s %d weight %g",i+1,srv->host,srv->port,srv->weight);
+	    if (server_dead(srv))
+		Rprintf(" dead, retry in %.1fs",srv->retry_at - monotonic_time());
+	    else if (srv->errors > 0)
+		Rprintf(" errors %d",srv->errors);
+	    Rprintf("\n");
+	    if (srv->obuf){
+		Rprintf("  obuf->count: %lu\n",(unsigned long)srv->obuf->count);
+		Rprintf("  obuf->size: %lu\n",(unsigned long)srv->obuf->size);
+	    }
+	    if (srv->ibuf && srv->nwriting == 0){
+		Rprintf("  ibuf->count: %lu\n",(unsigned long)srv->ibuf->count);
+		Rprintf("  ibuf->size: %lu\n",(unsigned long)srv->ibuf->size);
+	    }
+	    if (srv->nquiet > 0)
+		Rprintf("  quiet batch: %d keys, %lu bytes\n",srv->nquiet,
+			(unsigned long)srv->qbuf->count);
 	}
     } else {
 	Rprintf("servers: 0\n");
     }
 
-    if (mcon->obuf){
-	Rprintf("obuf->count: %d\n",mcon->obuf->count);
-	Rprintf("obuf->size: %d\n",mcon->obuf->size);
-    }
-
-    if (mcon->ibuf){
-	Rprintf("ibuf->count: %d\n",mcon->ibuf->count);
-	Rprintf("ibuf->size: %d\n",mcon->ibuf->size);
-    }
-
     return R_NilValue;
 }
 
-SEXP mc_connect(SEXP srvlist, SEXP hashfun){
+SEXP mc_connect(SEXP srvlist, SEXP hashfun, SEXP distribution, SEXP weights,
+	SEXP protocol){
     mc_con *mcon;
     SEXP mcon_s;
+    int dist, proto;
+
+    if ((dist = parse_distribution(distribution)) == -1)
+	error("rmemcache: distribution must be \"modula\" or \"ketama\"");
+    if ((proto = parse_protocol(protocol)) == -1)
+	error("rmemcache: protocol must be \"ascii\" or \"binary\"");
 
     mcon = calloc(1,sizeof(mc_con));
+    mcon->distribution = dist;
+    mcon->protocol = proto;
+    mcon->retry_timeout = 1;
+    mcon->retry_max = 60;
+    mcon->connect_timeout = 2;
+    mcon->read_timeout = 2;
+    mcon->write_timeout = 2;
+    mcon->sockopts.nodelay = TRUE;
 
     PROTECT(mcon_s = R_MakeExternalPtr(mcon,MCCON_type_tag,R_NilValue));
     R_RegisterCFinalizer(mcon_s,mc_finalize_con);
     UNPROTECT(1);
 
     if (!isNull(srvlist)){
-	populate_srvlist(&mcon,srvlist);
+	populate_srvlist(&mcon,srvlist,weights);
     }
 
     mc_hashfun(mcon_s,hashfun);
@@ -199,24 +1150,60 @@ SEXP mc_connect(SEXP srvlist, SEXP hashfun){
     return mcon_s;
 }
 
-SEXP mc_setservers(SEXP mcon_s, SEXP srvlist){
+/* distribution may be NULL to keep the current one */
+SEXP mc_setservers(SEXP mcon_s, SEXP srvlist, SEXP weights, SEXP distribution){
+    int dist;
     mc_con *mcon = unmarshall_con(mcon_s);
     if (!mcon) return ScalarLogical(FALSE);
-    return ScalarLogical(populate_srvlist(&mcon,srvlist));
+
+    if (!isNull(distribution)){
+	if ((dist = parse_distribution(distribution)) == -1){
+	    warning("rmemcache: distribution must be \"modula\" or \"ketama\"");
+	    return ScalarLogical(FALSE);
+	}
+	mcon->distribution = dist;
+    }
+
+    /* Keys may now map to other servers, holding other values */
+    clear_near(mcon);
+    flush_quiet(mcon,0);
+
+    return ScalarLogical(populate_srvlist(&mcon,srvlist,weights));
 }
 
 
+/* hashfun is an R function, the name of one of mc_hashes, or NULL for
+ * the default. crc32 is for modula distribution only; with ketama keys
+ * are placed by md5 instead.
+ */
 SEXP mc_hashfun(SEXP mcon_s, SEXP hashfun){
+    int i;
     mc_con *mcon = unmarshall_con(mcon_s);
     if (!mcon) return ScalarLogical(FALSE);
 
-    if (isFunction(hashfun)){
+    if (isString(hashfun) && LENGTH(hashfun) == 1){
+	for (i = 0; i < MC_NHASHES; i++)
+	    if (strcmp(CHAR(STRING_ELT(hashfun,0)),mc_hashes[i].name) == 0)
+		break;
+	if (i == MC_NHASHES){
+	    warning("rmemcache: unknown hash function \"%s\"",
+		    CHAR(STRING_ELT(hashfun,0)));
+	    return ScalarLogical(FALSE);
+	}
+	if (mcon->hashfun) R_ReleaseObject(mcon->hashfun);
+	mcon->hashfun = NULL;
+	mcon->hash = i;
+    } else if (isFunction(hashfun)){
 	if (mcon->hashfun) R_ReleaseObject(mcon->hashfun);
 	R_PreserveObject(hashfun);
 	mcon->hashfun=hashfun;
     } else if (isNull(hashfun)){
 	if (mcon->hashfun) R_ReleaseObject(mcon->hashfun);
 	mcon->hashfun = NULL;
+	mcon->hash = 0;
+    } else {
+	warning("rmemcache: hashfun must be a function or a hash name!");
+	return ScalarLogical(FALSE);
     }
 
     return ScalarLogical(TRUE);
@@ -236,18 +1223,27 @@ static int hash_string(const char *s)
     return h;
 }
 
-/* 0 based indexing */
-static int hash_servers(mc_con *mcon, SEXP key){
+/* 0 based indexing. key is the i'th element of the character vector keys. */
+static int hash_server(mc_con *mcon, SEXP keys, int i){
     int h;
     char *pkey;
 
+    if (mcon->nservers == 0) return -1;
+
     /* Call user-defined hash function 
      * must return value between 0 and nservers-1 
      * 0 based indexing
      */
     if (mcon->hashfun){
-	SEXP val, expr, nservers;
+	SEXP val, expr, nservers, key;
 	int error = 1;
+	/* Setup key */
+	if (LENGTH(keys) == 1)
+	    key = keys;
+	else
+	    key = ScalarString(STRING_ELT(keys,i));
+	PROTECT(key);
+
 	/* Setup nservers */
 	PROTECT(nservers = allocVector(INTSXP,1));
 	INTEGER(nservers)[0] = mcon->nservers;
@@ -260,7 +1256,7 @@ static int hash_servers(mc_con *mcon, SEXP key){
 
 	val = R_tryEval(expr,NULL,&error);
 
-	UNPROTECT( 2 );
+	UNPROTECT( 3 );
 
 	if (error){
 	    warning("rmemcache: hash function failed!");
@@ -277,135 +1273,342 @@ static int hash_servers(mc_con *mcon, SEXP key){
 	}
     }
 
+    /* Consistent hashing on the continuum */
+    if (mcon->distribution == MC_DIST_KETAMA)
+	return ketama_server(mcon,CHAR(STRING_ELT(keys,i)));
+
     /* Otherwise fall back to internal hash function 
      * equal weight to servers
      * 0 based indexing
      */
-    h = hash_string(CHAR(STRING_ELT(key,0)));
+    pkey = (char *)CHAR(STRING_ELT(keys,i));
+    if (mc_hashes[mcon->hash].fun)
+	return mc_hashes[mcon->hash].fun(pkey,strlen(pkey)) % mcon->nservers;
+    h = hash_string(pkey);
 
     return h % mcon->nservers;
 
 }
 
-SEXP mc_hash(SEXP mcon_s, SEXP key){
-    int h;
-    mc_con *mcon = unmarshall_con(mcon_s);
-    if (!mcon) return R_NilValue;
-
-    h = hash_servers(mcon,key);
+/* Returns the server of the key keys[i], or -1 if it can't be hashed.
+ * With rehash, keys of dead servers go to live ones.
+ */
+static int hash_servers(mc_con *mcon, SEXP keys, int i){
+    int h = hash_server(mcon,keys,i);
 
-    if (h == -1) return R_NilValue;
-    return ScalarInteger(h);
+    if (h != -1 && mcon->rehash && server_dead(mcon->servers[h]))
+	h = rehash_server(mcon,CHAR(STRING_ELT(keys,i)),h);
+    return h;
 }
 
-/* round n to next power of two, 
- * minimum n will be 2**pow
+/* Replication. With replicas > 1, each key is kept on that many
+ * servers: the one hash_servers() picks and the next ones along, which
+ * with ketama are those on the continuum after the key. Stores, deletes
+ * and counter updates go to all copies at once, while gets fall over to
+ * the next copy for keys missing or on a server that failed.
  */
-static int round_power_two(int pow, int n){
-    int result = 1<<pow;
-    while (result < n) {
-	result <<= 1;
-	if (result <= 0)
-	    return -1;
-    }
-    return result;
+static int replica_count(mc_con *mcon){
+    if (mcon->replicas <= 1) return 1;
+    return (mcon->replicas < mcon->nservers)? mcon->replicas : mcon->nservers;
 }
 
-static mc_buf *init_buf(int size){
-    int realsize;
-    mc_buf *newbuf;
-    realsize = round_power_two(MC_DEFAULT_POW_TWO,size);
-
-    newbuf = calloc(1,sizeof(mc_buf));
-    if (!newbuf) return NULL;
+/* Returns the server of copy r of keys[i], or -1 if there are fewer
+ * servers or the key can't be hashed. seen must hold r + 1 ints.
+ */
+static int replica_server(mc_con *mcon, SEXP keys, int i, int r, int *seen){
+    int h = hash_servers(mcon,keys,i), p, n, j, k, idx;
 
-    newbuf->buf = calloc(realsize,1);
-    if (!newbuf->buf) return NULL;
-    newbuf->size = realsize;
-    newbuf->count = 0;
-    newbuf->curpos = 0;
+    if (h == -1 || r == 0) return h;
+    if (r >= mcon->nservers) return -1;
+    if (mcon->distribution != MC_DIST_KETAMA || mcon->hashfun)
+	return (h + r) % mcon->nservers;
 
-    return newbuf;
+    /* Count the servers along the continuum, skipping dead ones with
+     * rehash as hash_servers() does
+     */
+    seen[0] = h;
+    k = 1;
+    p = ketama_point(mcon,CHAR(STRING_ELT(keys,i)));
+    for (n = 0; n < mcon->npoints; n++, p = (p + 1) % mcon->npoints){
+	idx = mcon->continuum[p].index;
+	for (j = 0; j < k && seen[j] != idx; j++);
+	if (j < k || (mcon->rehash && server_dead(mcon->servers[idx])))
+	    continue;
+	if (k == r) return idx;
+	seen[k++] = idx;
+    }
+    return -1;
+}
+
+/* Returns copies of x for the n keys it goes with, recycled over them,
+ * one set after another for each of nrep copies of the keys. The
+ * elements are shared, not duplicated.
+ */
+static SEXP replicate_vector(SEXP x, int n, int nrep){
+    int j;
+    SEXP copies;
+
+    if (nrep == 1) return x; /* recycled by the caller as before */
+
+    PROTECT(copies = allocVector(TYPEOF(x),n * nrep));
+    for (j = 0; j < n * nrep; j++){
+	switch(TYPEOF(x)){
+	    case STRSXP:
+		SET_STRING_ELT(copies,j,STRING_ELT(x,(j % n) % LENGTH(x)));
+		break;
+	    case VECSXP:
+		SET_VECTOR_ELT(copies,j,VECTOR_ELT(x,(j % n) % LENGTH(x)));
+		break;
+	    case INTSXP:
+		INTEGER(copies)[j] = INTEGER(x)[(j % n) % LENGTH(x)];
+		break;
+	    default:
+		error("rmemcache: cannot replicate a vector of type %d",TYPEOF(x));
+	}
+    }
+    UNPROTECT(1);
+    return copies;
+}
+
+/* Folds the results for nrep copies of n keys into one per key: TRUE
+ * if any copy is TRUE, otherwise FALSE if any is, for logicals; the
+ * first copy's value that isn't NA for doubles.
+ */
+static SEXP fold_replicas(SEXP x, int n, int nrep){
+    int i, r;
+    SEXP folded;
+
+    if (nrep == 1) return x;
+
+    PROTECT(folded = allocVector(TYPEOF(x),n));
+    for (i = 0; i < n; i++){
+	if (TYPEOF(x) == LGLSXP){
+	    LOGICAL(folded)[i] = NA_LOGICAL;
+	    for (r = 0; r < nrep && LOGICAL(folded)[i] != TRUE; r++)
+		if (LOGICAL(x)[r * n + i] != NA_LOGICAL)
+		    LOGICAL(folded)[i] = LOGICAL(x)[r * n + i];
+	} else {
+	    REAL(folded)[i] = NA_REAL;
+	    for (r = 0; r < nrep && ISNAN(REAL(folded)[i]); r++)
+		REAL(folded)[i] = REAL(x)[r * n + i];
+	}
+    }
+    UNPROTECT(1);
+    return folded;
+}
+
+/* The server index of each key, NA where it can't be hashed */
+SEXP mc_hash(SEXP mcon_s, SEXP keys){
+    int i, h;
+    SEXP ret;
+    mc_con *mcon = unmarshall_con(mcon_s);
+    if (!mcon || !isString(keys)) return R_NilValue;
+
+    PROTECT(ret = allocVector(INTSXP,LENGTH(keys)));
+    for (i = 0; i < LENGTH(keys); i++){
+	h = (STRING_ELT(keys,i) == NA_STRING)? -1 : hash_servers(mcon,keys,i);
+	INTEGER(ret)[i] = (h == -1)? NA_INTEGER : h;
+    }
+    UNPROTECT(1);
+
+    return ret;
+}
+
+/* round n to next power of two, 
+ * minimum n will be 2**pow
+ */
+static int round_power_two(int pow, int n){
+    int result = 1<<pow;
+    while (result < n) {
+	result <<= 1;
+	if (result <= 0)
+	    return -1;
+    }
+    return result;
+}
+
+static mc_buf *init_buf(int size){
+    int realsize;
+    mc_buf *newbuf;
+    realsize = round_power_two(MC_DEFAULT_POW_TWO,size);
+
+    newbuf = malloc(sizeof(mc_buf));
+    if (!newbuf) return NULL;
+
+    newbuf->buf = malloc(realsize);
+    if (!newbuf->buf){
+	free(newbuf);
+	return NULL;
+    }
+    newbuf->size = realsize;
+    newbuf->count = 0;
+    newbuf->curpos = 0;
+
+    return newbuf;
+}
+
+/* Size class of a pooled buffer of size bytes */
+static int pool_class(size_t size){
+    int c = 0;
+    while (c < MC_POOL_CLASSES - 1 &&
+	    ((size_t)1 << (c + MC_DEFAULT_POW_TWO)) < size)
+	c++;
+    return c;
+}
+
+/* Takes the smallest pooled buffer of at least size bytes, allocating
+ * a new one if there is none.
+ */
+static mc_buf *get_buf(mc_con *mcon, int size){
+    int c;
+
+    for (c = pool_class(size); c < MC_POOL_CLASSES; c++)
+	if (mcon->npooled[c] > 0)
+	    return mcon->pool[c][--mcon->npooled[c]];
+
+    return init_buf(size);
+}
+
+/* Empties *buf and returns it to the pool, or frees it if the pool is
+ * full, recording its size in hwm.
+ */
+static void put_buf(mc_con *mcon, mc_buf **buf, size_t *hwm){
+    size_t max = (size_t)1 << MC_POOL_MAX_POW;
+    unsigned char *shrunk;
+    int c;
+
+    if (*buf == NULL) return;
+
+    if ((*buf)->size > *hwm) *hwm = (*buf)->size;
+    (*buf)->count = (*buf)->curpos = 0;
+
+    /* Shrink buffers grown by an oversized request */
+    if ((*buf)->size > max && (shrunk = realloc((*buf)->buf,max)) != NULL){
+	(*buf)->buf = shrunk;
+	(*buf)->size = max;
+    }
+
+    c = pool_class((*buf)->size);
+    if ((*buf)->size <= max && mcon->npooled[c] < MC_POOL_DEPTH){
+	mcon->pool[c][mcon->npooled[c]++] = *buf;
+	*buf = NULL;
+    } else {
+	destroy_buf(buf);
+    }
+}
+
+/* Returns the servers' buffers to the pool at the end of a call. If
+ * an R error cut the call short they stay with the servers instead,
+ * to be reused and returned by the next call. So does the ibuf of a
+ * server with asynchronous requests, which may hold their replies.
+ */
+static void release_iobufs(mc_con *mcon){
+    int i;
+
+    for (i = 0; i < mcon->nservers; i++){
+	put_buf(mcon,&mcon->servers[i]->obuf,&mcon->obuf_hwm);
+	if (mcon->servers[i]->pending == NULL)
+	    put_buf(mcon,&mcon->servers[i]->ibuf,&mcon->ibuf_hwm);
+    }
+    put_buf(mcon,&mcon->sbuf,&mcon->obuf_hwm);
 }
 
 /* 
  * Storage commands: add, set, replace
  *
  * client sends:
- *     <cmd> <key> <flags> <exptime> <bytes>\r\n
+ *     <cmd> <key> <flags> <exptime> <bytes> [noreply]\r\n
  *     <data>\r\n
  * server sends:
  *     STORED\r\n
  *     NOT_STORED\r\n
+ * and when noreply present:
+ *     NULL
  *
  * The strategy for initializing this buffer is to allocate enough 
  * memory to store the first protocol line sent plus the size (vzise) of the
  * serialized  r object. vsize is just an estimate from object.size(). Then
  * we write out as much  of the protocol string that we know into the
- * buffer. this includes  "<cmd> <key> <flags> <exptime> " plus the
- * NULL byte.   Later, after we've serialized the r object to the buffer,
- * we'll go back and fill  in the <bytes> field.
+ * buffer. this includes  "<cmd> <key> " plus the
+ * NULL byte.   Later, after we've serialized (and maybe compressed) the r
+ * object to the buffer, we'll go back and fill in the <flags>, <exptime>
+ * and <bytes> fields, and noreply if asked.
  * 
  * buf->count is set to the protbuflen (guaranteed to hold the max size
  * of the first  protocol line) so that we know where the protocol line
  * ends and the serialized value begins.
  *
- * The <bytes> value is written to the address of buf + strlen(buf->buf) 
- * after  serialization.
+ * The remaining fields are written to the address of buf + strlen(buf->buf) 
+ * after  serialization by serialize_store_buf(). The protocol line and
+ * the value are then queued as two segments of one writev(), so neither
+ * is copied.
+ *
+ * Several commands may be appended to the same buf this way, each
+ * followed by its serialized value.
  */
-static mc_buf *init_store_buf(const char *cmd, const char *key, 
-	size_t vsize, int exptime, int flags){
-    mc_buf *newbuf = NULL;
-    int protbuflen, buflen;
-
-    /* We double the following to later coallesce the first protocol line
-     * with the serialzed buffer.
-     */
-    protbuflen = round_power_two(1,
-	    (7 + 1           +     /* max size of command + 1 space */
-	     strlen(key) + 1  +      /* sizeof key + 1 space */
-	     10 + 1           +     /* 1 for flag + 1 space */
-	     10 + 1           +     /* max length of exptime + 1 space */
-	     10 + 3) * 2      );    /* max length of bytes  + \r\n and NULL */
-    buflen = round_power_two(MC_DEFAULT_POW_TWO, vsize  ); /* size of R object */           
+static int store_header_len(const char *key){
+    return round_power_two(1,
+	    7 + 1           +     /* max size of command + 1 space */
+	    strlen(key) + 1  +      /* sizeof key + 1 space */
+	    10 + 1           +     /* 1 for flag + 1 space */
+	    10 + 1           +     /* max length of exptime + 1 space */
+	    20 + 8           +     /* max length of bytes + " noreply" */
+	    3                );    /* length of \r\n and NULL */
+}
 
-    if ((newbuf = init_buf(protbuflen + buflen)) == NULL) return NULL;
+/* Appends the reserved protocol line for one storage command to buf and
+ * returns its offset.
+ */
+static size_t append_store_header(mc_buf *buf, const char *cmd, 
+	const char *key){
+    size_t hdrpos;
+    int protbuflen;
 
-    newbuf->count = protbuflen;
+    protbuflen = store_header_len(key);
+    resize_buf(buf, buf->count + protbuflen);
 
-    sprintf( (char *)newbuf->buf, "%s %s %d %d ", cmd, key, flags, exptime);
+    hdrpos = buf->count;
+    sprintf( (char *)buf->buf + hdrpos, "%s %s ", cmd, key);
+    buf->count += protbuflen;
 
-    return newbuf;
+    return hdrpos;
 }
+
 /*
- * Get 1 value command: get
+ * Get command: get
  *
  * client sends:
- *     get <key>\r\n
- * server sends when key found:
+ *     get <key>*\r\n
+ * server sends, for each key found and in the order requested:
  *     VALUE <key> <flags> <bytes>\r\n
  *     <data block>\r\n
- *     END\r\n
- * when key not found:
+ * followed by:
  *     END\r\n
  *
- * This buffer is initialized to "get <key>\r\n"
- * and count is set to strlen(buf->buf).
+ * Appends "get <key1> <key2> ... <keyn>\r\n" to buf using the n keys
+ * in keys whose index is listed in idx.
  */
-static mc_buf *init_get_buf(const char *key){
-    mc_buf *newbuf;
-    int protbuflen;
-
-    protbuflen = round_power_two(1,
-	    4               +  /* strlen("get") + 1 space */
-	    strlen(key) + 1 +  /* length of key + 1 space */
-	    2               ); /* length of \r\n */
-    if ((newbuf = init_buf(protbuflen)) == NULL) return NULL;
-
-    sprintf( (char *)newbuf->buf, "get %s\r\n", key);
-    newbuf->count = strlen((char *)newbuf->buf);
+static void append_get_cmd(mc_buf *buf, SEXP keys, int *idx, int n){
+    int protbuflen, i;
+    size_t len;
+    const char *key;
 
-    return newbuf;
+    protbuflen = 3 + 2 + 1; /* strlen("get") + length of \r\n and NULL */
+    for (i = 0; i < n; i++)
+	protbuflen += 1 + strlen(CHAR(STRING_ELT(keys,idx[i]))); /* 1 space + key */
+    resize_buf(buf, buf->count + protbuflen);
+
+    memcpy(buf->buf + buf->count,"get",3);
+    buf->count += 3;
+    for (i = 0; i < n; i++){
+	key = CHAR(STRING_ELT(keys,idx[i]));
+	len = strlen(key);
+	buf->buf[buf->count++] = ' ';
+	memcpy(buf->buf + buf->count, key, len);
+	buf->count += len;
+    }
+    memcpy(buf->buf + buf->count,"\r\n",3);
+    buf->count += 2;
 }
 
 /*
@@ -420,500 +1623,4375 @@ static mc_buf *init_get_buf(const char *key){
  * and when noreply present:
  *     NULL
  *
- * This buffer is initialized to "delete <key> [noreply]\r\n"
- * and count is set to strlen(buf->buf).
+ * Appends "delete <key> [noreply]\r\n" to buf.
  */
-static mc_buf *init_delete_buf(const char *key, int noreply){
-    mc_buf *newbuf;
+static void append_delete_cmd(mc_buf *buf, const char *key, int noreply){
     int protbuflen;
 
-    protbuflen = round_power_two(1,
-	    7               +  /* strlen("delete") + 1 space */
-	    strlen(key) + 1 +  /* length of key + 1 space */
-	    9               ); /* strlen("noreply") + length of \r\n */
-    if ((newbuf = init_buf(protbuflen)) == NULL) return NULL;
+    protbuflen = 7               +  /* strlen("delete") + 1 space */
+		 strlen(key) + 1 +  /* length of key + 1 space */
+		 7 + 3;             /* strlen("noreply") + length of \r\n and NULL */
+    resize_buf(buf, buf->count + protbuflen);
 
     if (noreply)
-	sprintf( (char *)newbuf->buf, "delete %s noreply\r\n", key);
+	sprintf( (char *)buf->buf + buf->count, "delete %s noreply\r\n", key);
     else
-	sprintf( (char *)newbuf->buf, "delete %s\r\n", key);
-    newbuf->count = strlen((char *)newbuf->buf);
-
-    return newbuf;
+	sprintf( (char *)buf->buf + buf->count, "delete %s\r\n", key);
+    buf->count += strlen((char *)buf->buf + buf->count);
 }
 
+/*
+ * Counter commands: incr, decr
+ *
+ * client sends:
+ *     <cmd> <key> <delta> [noreply]\r\n
+ * server sends the new value when key found:
+ *     <value>\r\n
+ * when key not found:
+ *     NOT_FOUND\r\n
+ * and when noreply present:
+ *     NULL
+ *
+ * delta and value are unsigned 64 bit integers. decr stops at 0 and
+ * incr wraps around.
+ *
+ * Appends "<cmd> <key> <delta> [noreply]\r\n" to buf.
+ */
+static void append_counter_cmd(mc_buf *buf, const char *cmd, const char *key,
+	unsigned long long delta, int noreply){
+    int protbuflen;
 
-static void resize_buf(mc_buf *buf, size_t needed)
-{
-    size_t newsize;
+    protbuflen = strlen(cmd) + 1 +  /* cmd + 1 space */
+		 strlen(key) + 1 +  /* length of key + 1 space */
+		 20 + 8 +           /* digits of delta + " noreply" */
+		 3;                 /* length of \r\n and NULL */
+    resize_buf(buf, buf->count + protbuflen);
 
-    if (needed <= buf->size) return;
+    sprintf( (char *)buf->buf + buf->count, "%s %s %llu%s\r\n", cmd, key, delta,
+	    (noreply)? " noreply" : "");
+    buf->count += strlen((char *)buf->buf + buf->count);
+}
 
-    newsize = round_power_two(MC_DEFAULT_POW_TWO,needed);
+/*
+ * Binary protocol
+ *
+ * Every request and response starts with a 24 byte header, with all
+ * fields in network byte order:
+ *
+ *     magic(1) opcode(1) key length(2) extras length(1) data type(1)
+ *     vbucket id or status(2) total body length(4) opaque(4) cas(8)
+ *
+ * followed by the extras, the key and the value. The quiet commands
+ * GETQ, SETQ, ADDQ, REPLACEQ and DELETEQ only reply on a hit (GETQ)
+ * or a failure (the others), so a batch of them is followed by a NOOP
+ * whose reply ends the batch. opaque is echoed back in the reply and
+ * holds the position of the key within the request.
+ *
+ * Keys are sent with their length and so may contain whitespace.
+ */
+static void put16(unsigned char *p, unsigned int v){
+    p[0] = (v >> 8) & 0xff;
+    p[1] = v & 0xff;
+}
 
-    buf->buf = realloc(buf->buf,newsize);
+static void put32(unsigned char *p, unsigned int v){
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
 
-    if (buf->buf == NULL){
-	/* this causes a break to on.exit() */
-	error("rmemcache: resize_buf() cannot allocate buffer");
-    }
-    buf->size = newsize;
+static unsigned int get16(const unsigned char *p){
+    return ((unsigned int)p[0] << 8) | p[1];
 }
 
-static void outchar(R_outpstream_t stream, int c){
-    mc_buf *buf = stream->data;
-    if (buf->count >= buf->size)
-	resize_buf(buf, buf->count + 1);
-    buf->buf[buf->count++] = c;
+static unsigned int get32(const unsigned char *p){
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+	((unsigned int)p[2] << 8) | p[3];
 }
 
-static void outbytes(R_outpstream_t stream, void *bytes, int len){
-    mc_buf *buf = stream->data;
-    if (buf->count + len > buf->size)
-	resize_buf(buf, buf->count + len);
-    memcpy(buf->buf + buf->count, bytes, len);
-    buf->count += len;
+static void put64(unsigned char *p, unsigned long long v){
+    put32(p,(unsigned int)(v >> 32));
+    put32(p + 4,(unsigned int)(v & 0xffffffff));
+}
+
+static unsigned long long get64(const unsigned char *p){
+    return ((unsigned long long)get32(p) << 32) | get32(p + 4);
 }
 
-/* Turns first read newline into NULL and returns address of
- * buf->buf[buf->curpos] before buf->curpos has been incremented.
- * Will not resize buf.
+/* Appends a request header to buf and returns its offset. The extras,
+ * key and value are appended by the caller.
  */
-static unsigned char * readline_buf(mc_srv *srv,mc_buf *buf){
-    int startpos, read, len;
-    int i=0,j=0;
+static size_t append_bin_header(mc_buf *buf, int opcode, size_t keylen,
+	int extlen, size_t bodylen, unsigned int opaque){
+    size_t hdrpos;
+    unsigned char *hdr;
+
+    resize_buf(buf, buf->count + MC_BIN_HDR_LEN + extlen + keylen);
+
+    hdrpos = buf->count;
+    hdr = buf->buf + hdrpos;
+    memset(hdr,0,MC_BIN_HDR_LEN);
+    hdr[0] = MC_BIN_REQ_MAGIC;
+    hdr[1] = opcode;
+    put16(hdr + 2,keylen);
+    hdr[4] = extlen;
+    put32(hdr + 8,bodylen);
+    put32(hdr + 12,opaque);
+    buf->count += MC_BIN_HDR_LEN;
+
+    return hdrpos;
+}
 
-    startpos = buf->curpos;
+static void append_bin_noop(mc_buf *buf, unsigned int opaque){
+    append_bin_header(buf,MC_BIN_NOOP,0,0,0,opaque);
+}
 
-    /* do we have a string already in the buffer */
-    len = buf->curpos;
-    while (len < buf->count){
-	if (buf->buf[len] == '\n'){
-	    buf->buf[len] = '\0';
-	    buf->curpos = len + 1;
-	    return buf->buf + startpos;
-	}
-	len++;
+/* Appends a GETQ for each of the n keys in keys whose index is listed
+ * in idx, then a NOOP.
+ */
+static void append_bin_get_cmd(mc_buf *buf, SEXP keys, int *idx, int n){
+    int i;
+    size_t len;
+    const char *key;
+
+    for (i = 0; i < n; i++){
+	key = CHAR(STRING_ELT(keys,idx[i]));
+	len = strlen(key);
+	append_bin_header(buf,MC_BIN_GETQ,len,0,len,i);
+	memcpy(buf->buf + buf->count, key, len);
+	buf->count += len;
     }
+    append_bin_noop(buf,n);
+}
 
-    /* No string, read some more from srv */
-    len = 0;
-    while (buf->size > buf->count){
+static int bin_store_opcode(const char *cmd){
+    if (strcmp(cmd,"set") == 0) return MC_BIN_SETQ;
+    if (strcmp(cmd,"add") == 0) return MC_BIN_ADDQ;
+    if (strcmp(cmd,"replace") == 0) return MC_BIN_REPLACEQ;
+    error("rmemcache: unknown storage command %s",cmd);
+    return -1;
+}
 
-	/* Wait for something to read */
-	/* if (mc_SocketWait(srv->scon,0) != 0) return NULL; *//* timeout */
+/* Appends the header, extras (flags and exptime) and key of a storage
+ * command and returns its offset. The flags and body length are filled
+ * in by serialize_bin_store_buf().
+ */
+static size_t append_bin_store_header(mc_buf *buf, int opcode,
+	const char *key, int exptime, unsigned int opaque){
+    size_t hdrpos, len;
+
+    len = strlen(key);
+    hdrpos = append_bin_header(buf,opcode,len,8,0,opaque);
+    put32(buf->buf + buf->count,0);
+    put32(buf->buf + buf->count + 4,exptime);
+    buf->count += 8;
+    memcpy(buf->buf + buf->count, key, len);
+    buf->count += len;
 
-	read = mc_SockRead(srv->scon,buf->buf+buf->count,buf->size - buf->count,1);
+    return hdrpos;
+}
 
-	if (read > 0){
-	    len = buf->count; /* old count */
-	    buf->count += read;
-	    j=0;
-	    while(read--){
-		if (buf->buf[len] == '\n'){
-		    buf->buf[len] = '\0';
-		    buf->curpos = len + 1;
-		    return buf->buf + startpos;
-		} 
-		len++;
-	    }
-	} else {
-	    switch(-read){
-		case EAGAIN:
-		case EINTR:
-		    continue;
-		    break;
-		case EINVAL: /* server went away */
-		case EBADF:
-		case EFAULT: 
-		default:
-		    return NULL; /* error */
-		    break;
-	    }
-	}
-    }
+static void append_bin_delete_cmd(mc_buf *buf, const char *key, unsigned int opaque){
+    size_t len;
 
-    /* We get here if there's no string read 
-     * and our buffer is full.
-     */
-    return NULL;
+    len = strlen(key);
+    append_bin_header(buf,MC_BIN_DELETEQ,len,0,len,opaque);
+    memcpy(buf->buf + buf->count, key, len);
+    buf->count += len;
 }
 
-static unsigned char * readbytes_buf(mc_srv *srv, mc_buf *buf, size_t bytes){
-    size_t startpos, read, len;
+/* Appends an INCREMENT or DECREMENT of key by delta. The extras hold
+ * the delta, an initial value and an expiration of 0xffffffff, which
+ * makes it fail on a missing key rather than create it, as the ascii
+ * protocol does. These aren't quiet, as the quiet forms don't return
+ * the new value.
+ */
+static void append_bin_counter_cmd(mc_buf *buf, int opcode, const char *key,
+	unsigned long long delta, unsigned int opaque){
+    size_t len;
+
+    len = strlen(key);
+    append_bin_header(buf,opcode,len,20,20 + len,opaque);
+    put64(buf->buf + buf->count,delta);
+    put64(buf->buf + buf->count + 8,0);
+    put32(buf->buf + buf->count + 16,0xffffffff);
+    buf->count += 20;
+    memcpy(buf->buf + buf->count, key, len);
+    buf->count += len;
+}
 
-    startpos = buf->curpos;
-    /* do we have bytes already in the buffer */
-    if ((buf->count - buf->curpos) >= bytes){
-	buf->curpos += bytes;
-	return buf->buf + startpos;
+/* Queues a storage command for len bytes of data stored as is rather
+ * than serialized, as chunks and manifests are.
+ */
+static void queue_raw_store(mc_con *mcon, mc_srv *srv, const char *cmd,
+	int opcode, const char *key, int flags, int exptime,
+	const void *data, size_t len, unsigned int opaque){
+    mc_buf *buf = srv->obuf;
+    size_t hdrpos;
+
+    if (mcon->protocol == MC_PROTO_BINARY){
+	hdrpos = append_bin_store_header(buf,opcode,key,exptime,opaque);
+	put32(buf->buf + hdrpos + 8,8 + strlen(key) + len);
+	put32(buf->buf + hdrpos + MC_BIN_HDR_LEN,flags);
+    } else {
+	hdrpos = append_store_header(buf,cmd,key);
+	sprintf((char *)buf->buf + hdrpos + strlen((char *)buf->buf + hdrpos),
+		"%d %d %lu\r\n",flags,exptime,(unsigned long)len);
+	buf->count = hdrpos + strlen((char *)buf->buf + hdrpos);
     }
 
-    /* Not enough, read some more from srv */
-    while (buf->size > buf->count){
-	read = mc_SockRead(srv->scon,buf->buf+buf->count,buf->size-buf->count,1);
-	if (read){
-	    buf->count += read;
-	    /* do we have bytes already in the buffer */
-	    if ((buf->count - buf->curpos) >= bytes){
-		buf->curpos += bytes;
-		return buf->buf + startpos;
-	    }
-	} else {
-	    return NULL; /* error */
-	}
+    resize_buf(buf, buf->count + len + 2);
+    memcpy(buf->buf + buf->count,data,len);
+    buf->count += len;
+    if (mcon->protocol == MC_PROTO_ASCII){
+	memcpy(buf->buf + buf->count,"\r\n",2);
+	buf->count += 2;
     }
 
-    return NULL; /* buffer is full but still not enough bytes */
+    queue_cmd(srv,hdrpos);
 }
 
-/* write out buf line including '\n' to srv, incrementing
- * curpos by number of bytes written.
- */
-static size_t writeline_buf(mc_srv *srv, mc_buf *buf){
-    size_t len = 0;
+static void resize_buf(mc_buf *buf, size_t needed)
+{
+    size_t newsize;
 
-    while( (buf->curpos+len) <= buf->count){
-	if (buf->buf[buf->curpos+len++] == '\n'){
-	    if (len == mc_SockWrite(srv->scon,buf->buf+buf->curpos,len)){
-		buf->curpos += len;
-		return len;
-	    } else {
-		return 0; /* socket error */
-	    }
-	}
-    }
+    if (needed <= buf->size) return;
+
+    newsize = round_power_two(MC_DEFAULT_POW_TWO,needed);
+
+    buf->buf = realloc(buf->buf,newsize);
 
-    return -1; /* no string found in buf*/
+    if (buf->buf == NULL){
+	/* this causes a break to on.exit() */
+	error("rmemcache: resize_buf() cannot allocate buffer");
+    }
+    buf->size = newsize;
 }
 
-/* won't write to srv if curpos+bytes past count */
-/* a return value of zero means either a sockwrite error or
- * curpos + bytes is larger than count
+/*
+ * Value compression
+ *
+ * R_Serialize() writes to an mc_ostream, which appends to buf until the
+ * value grows past threshold. From then on the value is compressed:
+ * what was written so far is run through the compressor, and further
+ * output is staged in MC_COMPRESS_CHUNK sized pieces and compressed a
+ * piece at a time, so the uncompressed value is never held in full.
+ *
+ * Values larger than MC_STREAM_CHUNK once serialized (and compressed)
+ * aren't held in full either. The first serialization only measures
+ * them, keeping no more than MC_STREAM_CHUNK bytes at a time, and they
+ * are then serialized again straight to the socket by stream_store()
+ * behind a header carrying the measured size. Both passes feed the
+ * compressor identically, so its output is the same.
+ *
+ * A value to be chunked is serialized to a scratch buffer instead, from
+ * which each chunk is queued on its server as soon as it's complete.
+ *
+ * The compression contexts are scratch space shared by all connections.
  */
-static size_t writebytes_buf(mc_srv *srv, mc_buf *buf, size_t bytes){
-    size_t ret = 0;
 
-    if (buf->count >= (buf->curpos + bytes))
-	ret = mc_SockWrite(srv->scon,buf->buf+buf->curpos,bytes);
-    buf->curpos += ret;
-    return ret;
+/* Where the chunks of a value go */
+typedef struct {
+    mc_con *mcon;
+    SEXP keys;          /* of the chunks */
+    int *srvidx;        /* server of each chunk */
+    int *nqueued;       /* chunks queued on each server */
+    int exptime;
+    size_t size;        /* bytes per chunk */
+    int next;           /* next chunk to queue */
+} mc_chunker;
+
+typedef struct {
+    mc_buf *buf;
+    size_t start;       /* offset of the value in buf */
+    size_t threshold;
+    int algo;           /* MC_COMPRESS_* to use past threshold */
+    int compressing;
+    size_t nchunk;      /* bytes staged in zchunk */
+    int measuring;      /* value is too large, only count its bytes */
+    size_t measured;    /* bytes counted and dropped, or streamed */
+    mc_srv *srv;        /* when streaming, the server to write to */
+    int failed;         /* a streaming write failed */
+    mc_chunker *chunker; /* when chunking, where chunks go */
+    int typed;          /* write typed payloads where possible */
+    int native;         /* serialize in native format */
+} mc_ostream;
+
+static unsigned char *zchunk;
+#ifdef HAVE_LIBLZ4
+static LZ4F_cctx *lz4_cctx;
+static LZ4F_dctx *lz4_dctx;
+#endif
+#ifdef HAVE_LIBZSTD
+static ZSTD_CCtx *zstd_cctx;
+static ZSTD_DCtx *zstd_dctx;
+#endif
+
+static int compress_available(int algo){
+#ifdef HAVE_LIBLZ4
+    if (algo == MC_COMPRESS_LZ4) return TRUE;
+#endif
+#ifdef HAVE_LIBZSTD
+    if (algo == MC_COMPRESS_ZSTD) return TRUE;
+#endif
+    return (algo == MC_COMPRESS_NONE);
 }
 
-static size_t seek_buf(mc_buf *buf, size_t s){
-    if (s >= 0 && s <= buf->size){
-	buf->curpos = s;
-	return s;
-    } else {
-	return -1;
+/* Starts a new compressed value at the end of buf. */
+static int compress_begin(mc_buf *buf, int algo){
+#ifdef HAVE_LIBLZ4
+    if (algo == MC_COMPRESS_LZ4){
+	size_t res;
+	if (lz4_cctx == NULL &&
+		LZ4F_isError(LZ4F_createCompressionContext(&lz4_cctx,LZ4F_VERSION)))
+	    return FALSE;
+	resize_buf(buf, buf->count + LZ4F_HEADER_SIZE_MAX);
+	res = LZ4F_compressBegin(lz4_cctx,buf->buf + buf->count,
+		buf->size - buf->count,NULL);
+	if (LZ4F_isError(res)) return FALSE;
+	buf->count += res;
+	return TRUE;
     }
+#endif
+#ifdef HAVE_LIBZSTD
+    if (algo == MC_COMPRESS_ZSTD){
+	if (zstd_cctx == NULL && (zstd_cctx = ZSTD_createCCtx()) == NULL)
+	    return FALSE;
+	ZSTD_CCtx_reset(zstd_cctx,ZSTD_reset_session_only);
+	return TRUE;
+    }
+#endif
+    return FALSE;
 }
 
-static int error_occured(char *response){
-    char *error_msg;
-    if (strcmp("ERROR\r",response) == 0){
-	warning("rmemcache: client sent a nonexistent command!");
-	return 1;
-    }
-    if (strncmp("CLIENT_ERROR ",response,13) == 0){
-	error_msg = response + 13;
-	warning("rmemcache: %s",error_msg);
-	return 1;
+/* Compresses len bytes to the end of buf, ending the value if end. */
+static int compress_bytes(mc_buf *buf, int algo, const unsigned char *src,
+	size_t len, int end){
+#ifdef HAVE_LIBLZ4
+    if (algo == MC_COMPRESS_LZ4){
+	size_t res;
+	resize_buf(buf, buf->count + LZ4F_compressBound(len,NULL));
+	res = LZ4F_compressUpdate(lz4_cctx,buf->buf + buf->count,
+		buf->size - buf->count,src,len,NULL);
+	if (LZ4F_isError(res)) return FALSE;
+	buf->count += res;
+	if (end){
+	    resize_buf(buf, buf->count + LZ4F_compressBound(0,NULL));
+	    res = LZ4F_compressEnd(lz4_cctx,buf->buf + buf->count,
+		    buf->size - buf->count,NULL);
+	    if (LZ4F_isError(res)) return FALSE;
+	    buf->count += res;
+	}
+	return TRUE;
     }
-    if (strncmp("SERVER_ERROR ",response,13) == 0){
-	error_msg = response + 13;
-	warning("rmemcache: %s",error_msg);
-	return 1;
+#endif
+#ifdef HAVE_LIBZSTD
+    if (algo == MC_COMPRESS_ZSTD){
+	ZSTD_inBuffer in = { src, len, 0 };
+	ZSTD_outBuffer out;
+	size_t res;
+	do {
+	    resize_buf(buf, buf->count + ZSTD_CStreamOutSize());
+	    out.dst = buf->buf + buf->count;
+	    out.size = buf->size - buf->count;
+	    out.pos = 0;
+	    res = ZSTD_compressStream2(zstd_cctx,&out,&in,
+		    (end)? ZSTD_e_end : ZSTD_e_continue);
+	    if (ZSTD_isError(res)) return FALSE;
+	    buf->count += out.pos;
+	} while ((end)? res != 0 : in.pos < in.size);
+	return TRUE;
     }
-
-    return 0;
+#endif
+    return FALSE;
 }
 
-/* 
- * Storage commands: add, set, replace
- *
- * client sends:
- *     <cmd> <key> <flags> <exptime> <bytes>\r\n
- *     <data>\r\n
- * server sends:
- *     STORED\r\n
- *     NOT_STORED\r\n
+/* Switches os to compressing once the value has grown past threshold.
+ * The value written so far is moved out of the way and compressed back
+ * in its place.
  */
-SEXP mc_store(SEXP mcon_s, SEXP key, SEXP value, SEXP exptime, SEXP cmd){
-    int i;
-    size_t true_vsize, protbufsize, true_lsize, cmd_size, start_cmd;
-    char *outbuf, *response;
-    mc_srv *srv;
-    struct R_outpstream_st out;
-    mc_con *mcon = unmarshall_con(mcon_s);
+static void start_compressing(mc_ostream *os){
+    mc_buf *buf = os->buf;
+    size_t len = buf->count - os->start;
+    unsigned char *raw;
+    int ok;
+
+    if (zchunk == NULL && (zchunk = malloc(MC_COMPRESS_CHUNK)) == NULL)
+	error("rmemcache: cannot allocate compression buffer");
+    if ((raw = malloc(len)) == NULL)
+	error("rmemcache: cannot allocate compression buffer");
+    memcpy(raw,buf->buf + os->start,len);
+    buf->count = os->start;
+
+    ok = compress_begin(buf,os->algo) && compress_bytes(buf,os->algo,raw,len,FALSE);
+    free(raw);
+    if (!ok) error("rmemcache: compression failed");
+
+    os->compressing = TRUE;
+    os->nchunk = 0;
+}
 
-    if (!mcon) return ScalarLogical(FALSE);
+/* Queues the next len bytes of the value in os as a set of its next
+ * chunk.
+ */
+static void queue_chunk(mc_ostream *os, size_t len){
+    mc_chunker *ck = os->chunker;
 
-    /* Determine which server we'll be working with */
-    i = hash_servers(mcon,key);
-    if (i == -1) return ScalarLogical(FALSE);
-    srv = mcon->servers[i];
+    if (ck->next >= LENGTH(ck->keys))
+	error("rmemcache: value changed size while being chunked");
 
-    /* Connect to it */
-    if (srv->scon == -1 && (srv->scon = mc_SockConnect(srv->port,srv->host)) == -1)
-	return ScalarLogical(FALSE);
+    queue_raw_store(ck->mcon,ck->mcon->servers[ck->srvidx[ck->next]],"set",
+	    MC_BIN_SETQ,CHAR(STRING_ELT(ck->keys,ck->next)),0,ck->exptime,
+	    os->buf->buf + os->start,len,ck->nqueued[ck->srvidx[ck->next]]++);
+    os->start += len;
+    ck->next++;
+}
 
-    /* Allocate mem for serialized value plus protocol*/
-    if ((mcon->obuf = init_store_buf(CHAR(STRING_ELT(cmd,0)),CHAR(STRING_ELT(key,0)),4096,INTEGER(exptime)[0],0)) == NULL)
-	return ScalarLogical(FALSE);
+/* Queues every chunk of the value in os that is complete, or with end
+ * whatever is left of it as the last.
+ */
+static void flush_chunks(mc_ostream *os, int end){
+    mc_buf *buf = os->buf;
+    size_t size = os->chunker->size;
+
+    while (buf->count - os->start >= size)
+	queue_chunk(os,size);
+    if (end && buf->count > os->start)
+	queue_chunk(os,buf->count - os->start);
+
+    if (os->start > 0 && buf->count > os->start)
+	memmove(buf->buf,buf->buf + os->start,buf->count - os->start);
+    buf->count -= os->start;
+    os->start = 0;
+}
 
-    protbufsize = mcon->obuf->count;
+/* Keeps what os holds of a large value to MC_STREAM_CHUNK bytes, by
+ * writing it out when streaming or counting and dropping it otherwise.
+ * When chunking, it's kept to a chunk instead. Nothing is dropped while
+ * compression may still start, as the bytes are needed to begin it.
+ */
+static void limit_ostream(mc_ostream *os){
+    mc_buf *buf = os->buf;
+    size_t len = buf->count - os->start;
+
+    if (os->algo != MC_COMPRESS_NONE && !os->compressing) return;
+    if (os->chunker){
+	if (len >= os->chunker->size) flush_chunks(os,FALSE);
+	return;
+    }
+    if (len <= MC_STREAM_CHUNK && !os->measuring) return;
+
+    if (os->srv){
+	if (len < MC_STREAM_CHUNK) return;
+	if (!os->failed && mc_SockWrite(os->srv->scon,buf->buf,buf->count,
+		    os->srv->write_timeout) != buf->count)
+	    os->failed = TRUE;
+	os->srv->sent += buf->count;
+	os->measured += len;
+	buf->count = os->start = 0;
+	return;
+    }
 
-    /* Serialize to buf. may have to use setjmp/longjmp if an error occurs.  */
-    R_InitOutPStream(&out,mcon->obuf,R_pstream_xdr_format,0,
-	    outchar, outbytes, NULL, R_NilValue);
-    R_Serialize(value,&out);
-    true_vsize = mcon->obuf->count - protbufsize;
+    os->measuring = TRUE;
+    os->measured += len;
+    buf->count = os->start;
+}
 
-    /* Append "\r\n" */
-    outbytes(&out,(void *)"\r\n",2);
+static void outbytes(R_outpstream_t stream, void *bytes, int len){
+    mc_ostream *os = stream->data;
+    mc_buf *buf = os->buf;
+    size_t n;
+
+    if (os->compressing){
+	while (len > 0){
+	    n = MC_COMPRESS_CHUNK - os->nchunk;
+	    if (n > len) n = len;
+	    memcpy(zchunk + os->nchunk, bytes, n);
+	    os->nchunk += n;
+	    bytes = (char *)bytes + n;
+	    len -= n;
+	    if (os->nchunk == MC_COMPRESS_CHUNK){
+		if (!compress_bytes(buf,os->algo,zchunk,os->nchunk,FALSE))
+		    error("rmemcache: compression failed");
+		os->nchunk = 0;
+		limit_ostream(os);
+	    }
+	}
+	return;
+    }
 
-    /* Grab size of serialized object and store in buf*/
-    sprintf(
-	    (char *)((void *)mcon->obuf->buf + strlen(mcon->obuf->buf)),
-	    "%d\r\n",
-	    true_vsize
-	   );
-    true_lsize = strlen(mcon->obuf->buf);
+    if (buf->count + len > buf->size)
+	resize_buf(buf, buf->count + len);
+    memcpy(buf->buf + buf->count, bytes, len);
+    buf->count += len;
 
-    start_cmd = protbufsize - true_lsize;
+    if (os->algo != MC_COMPRESS_NONE && buf->count - os->start > os->threshold)
+	start_compressing(os);
+    limit_ostream(os);
+}
 
-    /* Coallesce protocol line and serialized value */
-    memcpy(mcon->obuf->buf+start_cmd,mcon->obuf->buf,true_lsize);
+static void outchar(R_outpstream_t stream, int c){
+    unsigned char ch = c;
+    outbytes(stream,&ch,1);
+}
 
-    cmd_size = mcon->obuf->count - start_cmd;
+static void init_ostream(mc_ostream *os, mc_con *mcon, mc_buf *buf){
+    memset(os,0,sizeof(mc_ostream));
+    os->buf = buf;
+    os->start = buf->count;
+    os->threshold = mcon->threshold;
+    os->algo = (mcon->threshold > 0)? mcon->compress : MC_COMPRESS_NONE;
+    os->typed = mcon->typed;
+    os->native = mcon->native;
+}
 
-    /* Write full memcached command */
-    seek_buf(mcon->obuf,start_cmd);
-    if (cmd_size != writebytes_buf(srv,mcon->obuf,cmd_size)){
-	destroy_iobufs(mcon);
-	return ScalarLogical(FALSE);
+/* Returns the MC_TYPE_* value is written as. */
+static int payload_type(mc_ostream *os, SEXP value){
+    if (os->typed && ATTRIB(value) == R_NilValue){
+	switch (TYPEOF(value)){
+	    case RAWSXP:
+		return MC_TYPE_RAW;
+	    case STRSXP:
+		if (LENGTH(value) == 1 && STRING_ELT(value,0) != NA_STRING)
+		    return MC_TYPE_STRING;
+		break;
+	    case REALSXP:
+		return MC_TYPE_DOUBLE;
+	    case INTSXP:
+		return MC_TYPE_INTEGER;
+	}
     }
+    return (os->native)? MC_TYPE_NATIVE : MC_TYPE_XDR;
+}
 
-    /* Read result from server, should only be 1 line */
-    if ((mcon->ibuf = init_buf(1)) == NULL){ 
-	destroy_iobufs(mcon);
-	return ScalarLogical(FALSE);
+/* Writes value as a typed payload. The header of a double or integer
+ * vector is 'd' or 'i', the element size, two zero bytes and the
+ * number of elements as a little-endian 32 bit integer. The bytes go
+ * out MC_COMPRESS_CHUNK at a time so that large values stream.
+ */
+static void write_typed(R_outpstream_t out, SEXP value, int type){
+    const unsigned char *src;
+    unsigned char hdr[MC_TYPED_HEADER];
+    size_t len, n, size = 1;
+#ifdef WORDS_BIGENDIAN
+    unsigned char *swapped = NULL;
+    size_t i, j;
+#endif
+
+    switch (type){
+	case MC_TYPE_RAW:
+	    src = RAW(value);
+	    len = LENGTH(value);
+	    break;
+	case MC_TYPE_STRING:
+	    src = (const unsigned char *)translateCharUTF8(STRING_ELT(value,0));
+	    len = strlen((const char *)src);
+	    break;
+	default:
+	    size = (type == MC_TYPE_DOUBLE)? sizeof(double) : sizeof(int);
+	    src = (type == MC_TYPE_DOUBLE)? (const unsigned char *)REAL(value) :
+		(const unsigned char *)INTEGER(value);
+	    len = LENGTH(value);
+	    hdr[0] = (type == MC_TYPE_DOUBLE)? 'd' : 'i';
+	    hdr[1] = size;
+	    hdr[2] = hdr[3] = 0;
+	    for (n = 0; n < 4; n++) hdr[4 + n] = (len >> (8 * n)) & 0xff;
+	    outbytes(out,hdr,MC_TYPED_HEADER);
+	    len *= size;
+#ifdef WORDS_BIGENDIAN
+	    swapped = (unsigned char *)R_alloc(MC_COMPRESS_CHUNK,1);
+#endif
+	    break;
     }
 
-    response = readline_buf(srv,mcon->ibuf);
+    while (len > 0){
+	n = (len < MC_COMPRESS_CHUNK)? len : MC_COMPRESS_CHUNK;
+#ifdef WORDS_BIGENDIAN
+	if (swapped){
+	    for (i = 0; i < n; i += size)
+		for (j = 0; j < size; j++)
+		    swapped[i + j] = src[i + size - 1 - j];
+	    outbytes(out,swapped,n);
+	} else
+#endif
+	outbytes(out,(void *)src,n);
+	src += n;
+	len -= n;
+    }
+}
+
+/* Serializes value with os and finishes compressing it. Returns the
+ * item flags.
+ */
+static int serialize_ostream(mc_ostream *os, SEXP value){
+    struct R_outpstream_st out;
+    int type = payload_type(os,value);
+
+    /* Serialize to buf. may have to use setjmp/longjmp if an error occurs.  */
+    R_InitOutPStream(&out,os,(type == MC_TYPE_NATIVE)? R_pstream_binary_format :
+	    R_pstream_xdr_format,0, outchar, outbytes, NULL, R_NilValue);
+    if (type == MC_TYPE_XDR || type == MC_TYPE_NATIVE){
+	R_Serialize(value,&out);
+    } else {
+	os->algo = MC_COMPRESS_NONE;
+	write_typed(&out,value,type);
+    }
+
+    if (!os->compressing) return type;
+
+    if (!compress_bytes(os->buf,os->algo,zchunk,os->nchunk,TRUE))
+	error("rmemcache: compression failed");
+    return type | ((os->algo == MC_COMPRESS_LZ4)? MC_FLAG_LZ4 : MC_FLAG_ZSTD);
+}
+
+/* Serializes value to the end of buf, compressing it if it's larger
+ * than the connection's threshold, and sets size to its length.
+ * Returns the item flags. A value larger than MC_STREAM_CHUNK is only
+ * measured and left out of buf, to be sent by stream_store().
+ */
+static int serialize_value(mc_con *mcon, mc_buf *buf, SEXP value, size_t *size){
+    mc_ostream os;
+    int flags;
+
+    init_ostream(&os,mcon,buf);
+    flags = serialize_ostream(&os,value);
+
+    *size = os.measured + buf->count - os.start;
+    if (os.measuring) buf->count = os.start;
+
+    return flags;
+}
+
+/* Whether a value that serialized to size bytes is too large to be
+ * queued with the others, and must be streamed or chunked instead.
+ */
+static int store_apart(mc_con *mcon, size_t size){
+    if (mcon->chunksize > 0)
+	return size > (size_t)mcon->chunksize;
+    return size > MC_STREAM_CHUNK;
+}
+
+/* Serializes value to the end of buf, appends "\r\n", and fills in the
+ * <flags>, <exptime> and <bytes> fields of the protocol line appended
+ * at hdrpos by append_store_header(). Both are then queued to be
+ * written. Returns FALSE, leaving out the command, if the value is to
+ * be streamed or chunked, having set flags and size for stream_store()
+ * or chunk_store().
+ */
+static int serialize_store_buf(mc_con *mcon, mc_srv *srv, size_t hdrpos,
+	SEXP value, int exptime, int noreply, int *flags, size_t *size){
+    mc_buf *buf = srv->obuf;
+    size_t protbufend;
+    char *hdr;
+
+    protbufend = buf->count;
+
+    *flags = serialize_value(mcon,buf,value,size);
+    if (store_apart(mcon,*size)){
+	buf->count = hdrpos;
+	return FALSE;
+    }
+
+    /* Append "\r\n" */
+    resize_buf(buf, buf->count + 2);
+    memcpy(buf->buf + buf->count,"\r\n",2);
+    buf->count += 2;
+
+    /* Grab size of serialized object and store in buf. buf->buf
+     * may have moved during serialization.
+     */
+    hdr = (char *)buf->buf + hdrpos;
+    sprintf(hdr + strlen(hdr), "%d %d %lu%s\r\n", *flags, exptime,
+	    (unsigned long)*size, (noreply)? " noreply" : "");
+
+    queue_seg(srv,hdrpos,strlen(hdr));
+    queue_seg(srv,protbufend,buf->count - protbufend);
+
+    return TRUE;
+}
+
+/* Serializes value after the storage command appended at hdrpos by
+ * append_bin_store_header(), fills in its flags and body length, and
+ * queues it to be written. Returns FALSE, leaving out the command, if
+ * the value is to be streamed or chunked, having set flags and size
+ * for stream_store() or chunk_store().
+ */
+static int serialize_bin_store_buf(mc_con *mcon, mc_srv *srv, size_t hdrpos,
+	SEXP value, int *flags, size_t *size){
+    mc_buf *buf = srv->obuf;
+
+    *flags = serialize_value(mcon,buf,value,size);
+    if (store_apart(mcon,*size)){
+	buf->count = hdrpos;
+	return FALSE;
+    }
+
+    put32(buf->buf + hdrpos + 8,buf->count - hdrpos - MC_BIN_HDR_LEN);
+    put32(buf->buf + hdrpos + MC_BIN_HDR_LEN,*flags);
+    queue_seg(srv,hdrpos,buf->count - hdrpos);
+
+    return TRUE;
+}
+
+/* Discard everything before curpos, moving any unread bytes to the
+ * front of buf.
+ */
+static void compact_buf(mc_buf *buf){
+    if (buf->curpos == 0) return;
+    if (buf->count > buf->curpos)
+	memmove(buf->buf, buf->buf + buf->curpos, buf->count - buf->curpos);
+    buf->count -= buf->curpos;
+    buf->curpos = 0;
+}
+
+/* Returns the address of the line starting at buf->curpos and sets len
+ * to its length including the newline, or NULL if the newline hasn't
+ * been read yet. Does not move curpos.
+ */
+static char *peekline_buf(mc_buf *buf, size_t *len){
+    unsigned char *nl;
+
+    if (buf->curpos >= buf->count) return NULL;
+
+    nl = memchr(buf->buf + buf->curpos, '\n', buf->count - buf->curpos);
+    if (nl == NULL) return NULL;
+
+    *len = nl - (buf->buf + buf->curpos) + 1;
+    return (char *)buf->buf + buf->curpos;
+}
+
+static int line_is(const char *line, size_t len, const char *reply){
+    return (len == strlen(reply) && strncmp(line,reply,len) == 0);
+}
+
+static int error_occured(char *response, size_t len){
+    if (line_is(response,len,"ERROR\r\n")){
+	warning("rmemcache: client sent a nonexistent command!");
+	return 1;
+    }
+    if (len > 13 && strncmp("CLIENT_ERROR ",response,13) == 0){
+	warning("rmemcache: %.*s",(int)(len - 15),response + 13);
+	return 1;
+    }
+    if (len > 13 && strncmp("SERVER_ERROR ",response,13) == 0){
+	warning("rmemcache: %.*s",(int)(len - 15),response + 13);
+	return 1;
+    }
+
+    return 0;
+}
+
+/* Parses "VALUE <key> <flags> <bytes> [<cas unique>]\r\n" as returned
+ * by peekline_buf(). key points into response and is not NULL terminated.
+ */
+static int parse_value_line(char *response, char **key, size_t *keylen,
+	int *flags, size_t *bytes){
+    char *rptr;
+
+    if (strncmp("VALUE ",response,6) != 0) return FALSE;
+    response += 6; /* move past "VALUE " */
+
+    /* Key */
+    *key = response;
+    while (*response != ' ' && *response != '\r' && *response != '\n') response++;
+    *keylen = response - *key;
+    if (*keylen == 0 || *response != ' ') return FALSE;
+
+    /* Flags */
+    rptr = NULL;
+    *flags = (int)strtol(response,&rptr,10);
+    if (rptr == NULL || response == rptr) return FALSE;
+    response = rptr;
+
+    /* bytes */
+    rptr = NULL;
+    *bytes = (size_t)strtoul(response,&rptr,10);
+    if (rptr == NULL || response == rptr) return FALSE;
+
+    return TRUE;
+}
+
+/* Returns the address of the binary response at buf->curpos and sets
+ * bodylen to the length of what follows its header, or NULL if it
+ * hasn't been completely read yet. Does not move curpos. A response
+ * with a bad magic byte is returned as is for the caller to reject.
+ * If stream is set, a body larger than MC_STREAM_CHUNK is returned as
+ * soon as its extras and key are in, for the value to be streamed.
+ */
+static unsigned char *peekresponse_buf(mc_buf *buf, size_t *bodylen,
+	int stream){
+    unsigned char *hdr;
+    size_t need;
+
+    if (buf->count - buf->curpos < MC_BIN_HDR_LEN) return NULL;
+
+    hdr = buf->buf + buf->curpos;
+    if (hdr[0] != MC_BIN_RES_MAGIC){
+	*bodylen = 0;
+	return hdr;
+    }
+
+    *bodylen = get32(hdr + 8);
+    need = MC_BIN_HDR_LEN + *bodylen;
+    if (stream && *bodylen > MC_STREAM_CHUNK)
+	need = MC_BIN_HDR_LEN + hdr[4] + get16(hdr + 2);
+    if (buf->count - buf->curpos < need){
+	compact_buf(buf);
+	resize_buf(buf,need);
+	return NULL;
+    }
+
+    return hdr;
+}
+
+/* Warns with the message in the body of a failed response */
+static void bin_error(unsigned char *hdr, size_t bodylen){
+    size_t skip = hdr[4] + get16(hdr + 2);
+
+    if (bodylen > skip)
+	warning("rmemcache: %.*s",(int)(bodylen - skip),(char *)hdr + MC_BIN_HDR_LEN + skip);
+    else
+	warning("rmemcache: server returned status 0x%04x",get16(hdr + 6));
+}
+
+/* Reads a len byte value starting at buf->curpos for R_Unserialize().
+ * A value that isn't all in buf yet is read from the socket scon as
+ * it's consumed, buf serving as a window onto it that's refilled
+ * whenever it runs dry, so decoding overlaps with the transfer and
+ * memory use is bounded by buf rather than the size of the value. A
+ * compressed value is likewise decompressed MC_COMPRESS_CHUNK bytes at
+ * a time as R_Unserialize() asks for more.
+ */
+typedef struct {
+    mc_buf *buf;
+    int scon;        /* -1 if the value is all in buf */
+    int timeout;     /* milliseconds to wait on each read from scon */
+    mc_srv *srv;     /* scon's server, NULL with it */
+    size_t left;     /* bytes of the value not yet consumed */
+    int algo;
+    size_t pos;      /* next byte of zchunk to return */
+    size_t len;      /* bytes decompressed into zchunk */
+} mc_istream;
+
+/* Returns how many bytes of the value are available at buf->curpos,
+ * blocking until more arrive from the socket if there are none.
+ */
+static size_t fill_istream(mc_istream *is){
+    mc_buf *buf = is->buf;
+    size_t n;
+    int res;
+
+    while ((n = buf->count - buf->curpos) == 0 && is->left > 0){
+	if (is->scon == -1) return 0;
+	buf->curpos = buf->count = 0;
+	res = mc_SockRead(is->scon,buf->buf,buf->size,is->timeout);
+	if (res == 0 || (res < 0 && -res != EAGAIN && -res != EINTR))
+	    error("rmemcache: read error while streaming a value");
+	if (res > 0){
+	    buf->count = res;
+	    if (is->srv) is->srv->received += res;
+	}
+    }
+
+    return (n < is->left)? n : is->left;
+}
+
+static void consume_istream(mc_istream *is, size_t n){
+    is->buf->curpos += n;
+    is->left -= n;
+}
+
+static void read_istream(mc_istream *is, void *bytes, size_t length){
+    mc_buf *buf = is->buf;
+    size_t n;
+
+    while (length > 0){
+	if ((n = fill_istream(is)) == 0)
+	    error("rmemcache: read error in inbytes()");
+	if (n > length) n = length;
+	memcpy(bytes,buf->buf + buf->curpos,n);
+	consume_istream(is,n);
+	bytes = (char *)bytes + n;
+	length -= n;
+    }
+}
+
+static void inbytes(R_inpstream_t stream, void *bytes, int length){
+    read_istream(stream->data,bytes,length);
+}
+
+static int inchar(R_inpstream_t stream){
+    unsigned char c;
+    inbytes(stream,&c,1);
+    return c;
+}
+
+/* Decompresses the next piece of the value into zchunk. */
+static void decompress_chunk(mc_istream *is){
+    size_t srclen, dstlen;
+
+    is->pos = is->len = 0;
+    while (is->len == 0){
+	if ((srclen = fill_istream(is)) == 0)
+	    error("rmemcache: read error in decompress_chunk()");
+	dstlen = MC_COMPRESS_CHUNK;
+#ifdef HAVE_LIBLZ4
+	if (is->algo == MC_COMPRESS_LZ4 &&
+		LZ4F_isError(LZ4F_decompress(lz4_dctx,zchunk,&dstlen,
+			is->buf->buf + is->buf->curpos,&srclen,NULL)))
+	    error("rmemcache: lz4 decompression failed");
+#endif
+#ifdef HAVE_LIBZSTD
+	if (is->algo == MC_COMPRESS_ZSTD){
+	    ZSTD_inBuffer in = { is->buf->buf + is->buf->curpos, srclen, 0 };
+	    ZSTD_outBuffer out = { zchunk, dstlen, 0 };
+	    if (ZSTD_isError(ZSTD_decompressStream(zstd_dctx,&out,&in)))
+		error("rmemcache: zstd decompression failed");
+	    srclen = in.pos;
+	    dstlen = out.pos;
+	}
+#endif
+	consume_istream(is,srclen);
+	is->len = dstlen;
+    }
+}
+
+static void zinbytes(R_inpstream_t stream, void *bytes, int length){
+    mc_istream *is = stream->data;
+    size_t n;
+
+    while (length > 0){
+	if (is->pos == is->len) decompress_chunk(is);
+	n = is->len - is->pos;
+	if (n > length) n = length;
+	memcpy(bytes,zchunk + is->pos,n);
+	is->pos += n;
+	bytes = (char *)bytes + n;
+	length -= n;
+    }
+}
+
+static int zinchar(R_inpstream_t stream){
+    unsigned char c;
+    zinbytes(stream,&c,1);
+    return c;
+}
+
+/* Reads the typed payload of the given MC_TYPE_* that is what's left
+ * of is straight into a new vector. Returns NULL with a warning if it's
+ * malformed.
+ */
+static SEXP read_typed(mc_istream *is, int type){
+    unsigned char hdr[MC_TYPED_HEADER];
+    size_t n, size, len = is->left;
+    SEXP value;
+    char *s;
+#ifdef WORDS_BIGENDIAN
+    unsigned char *p, c;
+    size_t i, j;
+#endif
+
+    switch (type){
+	case MC_TYPE_RAW:
+	    value = allocVector(RAWSXP,len);
+	    read_istream(is,RAW(value),len);
+	    return value;
+	case MC_TYPE_STRING:
+	    s = R_alloc(len + 1,1);
+	    read_istream(is,s,len);
+	    s[len] = '\0';
+	    if (strlen(s) != len) break;
+	    return ScalarString(mkCharLenCE(s,len,CE_UTF8));
+	case MC_TYPE_DOUBLE:
+	case MC_TYPE_INTEGER:
+	    if (len < MC_TYPED_HEADER) break;
+	    read_istream(is,hdr,MC_TYPED_HEADER);
+	    size = (type == MC_TYPE_DOUBLE)? sizeof(double) : sizeof(int);
+	    for (n = 0, len = 0; n < 4; n++) len |= (size_t)hdr[4 + n] << (8 * n);
+	    if (hdr[0] != ((type == MC_TYPE_DOUBLE)? 'd' : 'i') || hdr[1] != size ||
+		    len * size != is->left)
+		break;
+	    value = allocVector((type == MC_TYPE_DOUBLE)? REALSXP : INTSXP,len);
+	    read_istream(is,(type == MC_TYPE_DOUBLE)? (void *)REAL(value) :
+		    (void *)INTEGER(value),len * size);
+#ifdef WORDS_BIGENDIAN
+	    p = (type == MC_TYPE_DOUBLE)? (unsigned char *)REAL(value) :
+		(unsigned char *)INTEGER(value);
+	    for (i = 0; i < len * size; i += size)
+		for (j = 0; j < size / 2; j++){
+		    c = p[i + j];
+		    p[i + j] = p[i + size - 1 - j];
+		    p[i + size - 1 - j] = c;
+		}
+#endif
+	    return value;
+    }
+
+    warning("rmemcache: malformed payload of type %d",type);
+    return R_NilValue;
+}
+
+/* Unserializes the len byte value at buf->curpos, stored with flags,
+ * streaming whatever of it hasn't been read yet from scon. Sets left
+ * to the bytes of the value it didn't consume, which the caller has to
+ * skip. Returns NULL if it was compressed with an algorithm not built in.
+ * Typed payloads are read straight into their vector.
+ */
+static SEXP unserialize_value(mc_buf *buf, mc_srv *srv, size_t len, int flags,
+	size_t *left){
+    struct R_inpstream_st in;
+    mc_istream is;
+    SEXP value;
+    int type;
+
+    is.buf = buf;
+    is.scon = (srv)? srv->scon : -1;
+    is.timeout = (srv)? srv->read_timeout : 0;
+    is.srv = srv;
+    is.left = len;
+    is.algo = MC_COMPRESS_NONE;
+    is.pos = is.len = 0;
+
+    type = flags & MC_TYPE_MASK;
+    if (type != MC_TYPE_XDR && type != MC_TYPE_NATIVE){
+	if (type > MC_TYPE_NATIVE || (flags & (MC_FLAG_LZ4|MC_FLAG_ZSTD))){
+	    warning("rmemcache: value has unknown flags %d",flags);
+	    *left = len;
+	    return R_NilValue;
+	}
+	value = read_typed(&is,type);
+	*left = is.left;
+	return value;
+    }
+
+    if (flags & (MC_FLAG_LZ4|MC_FLAG_ZSTD)){
+	is.algo = (flags & MC_FLAG_LZ4)? MC_COMPRESS_LZ4 : MC_COMPRESS_ZSTD;
+	if (!compress_available(is.algo)){
+	    warning("rmemcache: value compressed with %s, which is not available",
+		    (is.algo == MC_COMPRESS_LZ4)? "lz4" : "zstd");
+	    *left = len;
+	    return R_NilValue;
+	}
+	if (zchunk == NULL && (zchunk = malloc(MC_COMPRESS_CHUNK)) == NULL)
+	    error("rmemcache: cannot allocate compression buffer");
+#ifdef HAVE_LIBLZ4
+	if (is.algo == MC_COMPRESS_LZ4){
+	    if (lz4_dctx == NULL &&
+		    LZ4F_isError(LZ4F_createDecompressionContext(&lz4_dctx,LZ4F_VERSION)))
+		error("rmemcache: cannot allocate lz4 context");
+	    LZ4F_resetDecompressionContext(lz4_dctx);
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	if (is.algo == MC_COMPRESS_ZSTD){
+	    if (zstd_dctx == NULL && (zstd_dctx = ZSTD_createDCtx()) == NULL)
+		error("rmemcache: cannot allocate zstd context");
+	    ZSTD_DCtx_reset(zstd_dctx,ZSTD_reset_session_only);
+	}
+#endif
+    }
+
+    if (is.algo == MC_COMPRESS_NONE)
+	R_InitInPStream(&in,&is,R_pstream_any_format,
+		inchar, inbytes, NULL, R_NilValue);
+    else
+	R_InitInPStream(&in,&is,R_pstream_any_format,
+		zinchar, zinbytes, NULL, R_NilValue);
+    value = R_Unserialize(&in);
+
+    *left = is.left;
+    return value;
+}
+
+/* Copies the len byte value at ibuf->curpos to chunk, streaming it as
+ * unserialize_value() does. A chunk of the wrong length is left for
+ * the caller to skip and counts as missing.
+ */
+static void copy_chunk(mc_srv *srv, mc_chunkdst *chunk, size_t len, size_t *left){
+    mc_istream is;
+    size_t n, off = 0;
+
+    *left = len;
+    if (len != chunk->len) return;
+
+    is.buf = srv->ibuf;
+    is.scon = srv->scon;
+    is.timeout = srv->read_timeout;
+    is.srv = srv;
+    is.left = len;
+    while (is.left > 0){
+	if ((n = fill_istream(&is)) == 0)
+	    error("rmemcache: read error in copy_chunk()");
+	memcpy(chunk->dst + off,is.buf->buf + is.buf->curpos,n);
+	consume_istream(&is,n);
+	off += n;
+    }
+    chunk->got = TRUE;
+    *left = 0;
+}
+
+/* Takes the len byte value at ibuf->curpos, stored with flags, as the
+ * reply for the key at index idx, and sets left to the bytes of it
+ * still to skip. A manifest is kept as a CHARSXP, to be replaced by
+ * the value reassembled from its chunks once the request is done.
+ */
+static void take_value(mc_srv *srv, int idx, size_t len, int flags,
+	size_t *left){
+    mc_req *req = &srv->req;
+    mc_buf *buf = srv->ibuf;
+
+    if (req->chunks){
+	copy_chunk(srv,&req->chunks[idx],len,left);
+	return;
+    }
+
+    if (flags & MC_FLAG_CHUNKED){
+	*left = len;
+	if (len >= MC_MANIFEST_MAX) return;
+	SET_VECTOR_ELT(req->result,idx,mkCharLen((char *)buf->buf + buf->curpos,len));
+	buf->curpos += len;
+	*left = 0;
+	return;
+    }
+
+    if (srv->timed){
+	double start = monotonic_time();
+	SET_VECTOR_ELT(req->result,idx,unserialize_value(buf,srv,len,flags,left));
+	srv->t_unserialize += monotonic_time() - start;
+	return;
+    }
+    SET_VECTOR_ELT(req->result,idx,unserialize_value(buf,srv,len,flags,left));
+}
+
+/* Discards the bytes of a reply left over after streaming its value.
+ * Returns FALSE if they haven't all been read yet.
+ */
+static int skip_reply(mc_srv *srv){
+    mc_buf *buf = srv->ibuf;
+    size_t n = buf->count - buf->curpos;
+
+    if (n > srv->req.skip) n = srv->req.skip;
+    buf->curpos += n;
+    srv->req.skip -= n;
+
+    return srv->req.skip == 0;
+}
+
+/*
+ * Request engine
+ *
+ * Each operation queues the commands for a server in srv->obuf, marking
+ * the bytes to write as segments, and sets up srv->req with the parser
+ * for their replies. run_requests() then drives all servers with a
+ * pending request at once: connects, writes and reads are non-blocking
+ * and multiplexed with mc_SocketPoll(), and replies are parsed as they
+ * arrive. It returns when every request is done or has failed.
+ */
+
+/* Clears srv's request and output queue, dropping its connection if a
+ * previous request was interrupted (e.g. by an R error) midstream, and
+ * with it any asynchronous request it was reading. The input kept for
+ * other asynchronous requests is left alone.
+ */
+static void reset_request(mc_srv *srv){
+    if (srv->req.status == MC_PENDING) close_srv(srv);
+    if (srv->reading){
+	finish_pending(srv->reading,FALSE);
+	srv->reading = NULL;
+    }
+    memset(&srv->req,0,sizeof(mc_req));
+    srv->nsegs = srv->curseg = 0;
+    srv->segoff = 0;
+    if (srv->obuf) srv->obuf->count = srv->obuf->curpos = 0;
+    if (srv->ibuf && srv->pending == NULL) srv->ibuf->count = srv->ibuf->curpos = 0;
+}
+
+static void read_pending(mc_con *mcon, mc_async *async);
+
+/* Readies every server for a new operation, first waiting for the I/O
+ * thread's writes and reading the replies to any asynchronous requests,
+ * which come ahead of its own. Any quiet batch is left to grow.
+ */
+static void begin_requests(mc_con *mcon){
+    int i;
+
+    io_reap(mcon,0);
+    for (i = 0; i < mcon->nservers; i++)
+	if (mcon->servers[i]->pending){
+	    read_pending(mcon,NULL);
+	    break;
+	}
+    for (i = 0; i < mcon->nservers; i++)
+	reset_request(mcon->servers[i]);
+}
+
+/* Readies every server for a new operation as begin_requests() does,
+ * writing any quiet batch first so that it reaches the servers ahead of
+ * the operation's commands.
+ */
+static void reset_requests(mc_con *mcon){
+    flush_quiet(mcon,0);
+    begin_requests(mcon);
+}
+
+/* Starts a new request on srv for n keys. */
+static int init_request(mc_con *mcon, mc_srv *srv, int (*parse)(mc_srv *),
+	SEXP keys, SEXP result, int *keyidx, int n){
+    reset_request(srv);
+
+    if (srv->obuf == NULL && (srv->obuf = get_buf(mcon,1)) == NULL) return FALSE;
+    if (srv->ibuf == NULL && (srv->ibuf = get_buf(mcon,1)) == NULL) return FALSE;
+
+    srv->req.status = MC_PENDING;
+    srv->req.parse = parse;
+    srv->req.keys = keys;
+    srv->req.result = result;
+    srv->req.keyidx = keyidx;
+    srv->req.n = n;
+    srv->read_timeout = timeout_ms(mcon->read_timeout);
+    srv->write_timeout = timeout_ms(mcon->write_timeout);
+    return TRUE;
+}
+
+/* Queues len obuf bytes from pos to be written. */
+static void queue_seg(mc_srv *srv, size_t pos, size_t len){
+    mc_seg *seg;
+
+    if (len == 0) return;
+
+    /* Extend the last segment if contiguous */
+    if (srv->nsegs){
+	seg = &srv->segs[srv->nsegs-1];
+	if (seg->pos + seg->len == pos){
+	    seg->len += len;
+	    return;
+	}
+    }
+
+    if (srv->nsegs == srv->maxsegs){
+	srv->maxsegs = (srv->maxsegs)? srv->maxsegs * 2 : 16;
+	srv->segs = realloc(srv->segs,srv->maxsegs * sizeof(mc_seg));
+	if (srv->segs == NULL){
+	    srv->nsegs = srv->maxsegs = 0;
+	    error("rmemcache: queue_cmd() cannot allocate segments");
+	}
+    }
+    seg = &srv->segs[srv->nsegs++];
+    seg->pos = pos;
+    seg->len = len;
+}
+
+/* Queues obuf bytes from pos to the end of obuf to be written. */
+static void queue_cmd(mc_srv *srv, size_t pos){
+    queue_seg(srv,pos,srv->obuf->count - pos);
+}
+
+static void fail_request(mc_srv *srv){
+    close_srv(srv);
+    srv->req.status = MC_FAILED;
+}
+
+/* Writes as much of the nsegs segments of buf from *curseg, *segoff
+ * bytes in, as socket scon will take, advancing both. Returns the
+ * number of bytes written, or a negative value on error. Safe to call
+ * from the I/O thread.
+ */
+static int send_segs(int scon, mc_buf *buf, mc_seg *segs, int nsegs,
+	int *curseg, size_t *segoff){
+    struct iovec iov[MC_IOV_BATCH];
+    size_t off = *segoff, left;
+    int i, n, res, sent;
+
+    for (i = *curseg, n = 0; i < nsegs && n < MC_IOV_BATCH; i++, n++){
+	iov[n].iov_base = buf->buf + segs[i].pos + off;
+	iov[n].iov_len = segs[i].len - off;
+	off = 0;
+    }
+
+    res = mc_SockSendv(scon,iov,n);
+    if (res < 0) return res;
+
+    sent = res;
+    while (res > 0){
+	left = segs[*curseg].len - *segoff;
+	if (res >= left){
+	    res -= left;
+	    (*curseg)++;
+	    *segoff = 0;
+	} else {
+	    *segoff += res;
+	    res = 0;
+	}
+    }
+    return sent;
+}
+
+/* Writes as much of srv's queued segments as the socket will take */
+static int send_srv(mc_srv *srv){
+    int res = send_segs(srv->scon,srv->obuf,srv->segs,srv->nsegs,
+	    &srv->curseg,&srv->segoff);
+
+    if (res > 0) srv->sent += res;
+    return res;
+}
+
+/* Reads whatever is available into srv->ibuf, growing it when full.
+ * Returns the number of bytes read, 0 if none were ready, or a negative
+ * value on error or when the server closed the connection.
+ */
+static int recv_srv(mc_srv *srv){
+    mc_buf *buf = srv->ibuf;
+    int res;
+
+    compact_buf(buf);
+    if (buf->count == buf->size)
+	resize_buf(buf, buf->size + 1);
+
+    res = mc_SockRead(srv->scon,buf->buf+buf->count,buf->size - buf->count,0);
+    if (res == 0) return -1;
+    if (res < 0){
+	switch(-res){
+	    case EAGAIN:
+	    case EINTR:
+		return 0;
+		break;
+	    default:
+		return res;
+		break;
+	}
+    }
+
+    buf->count += res;
+    srv->received += res;
+    return res;
+}
+
+/* Restarts the clock on srv's request for the phase it's in: a server
+ * times out when it goes a whole timeout without making progress.
+ */
+static void arm_timeout(mc_con *mcon, mc_srv *srv){
+    double timeout;
+
+    if (srv->connecting)
+	timeout = mcon->connect_timeout;
+    else if (srv->curseg < srv->nsegs)
+	timeout = mcon->write_timeout;
+    else
+	timeout = mcon->read_timeout;
+    srv->deadline = monotonic_time() + timeout;
+}
+
+static void run_requests(mc_con *mcon){
+    int i, n, nready, timed, *tried;
+    double now, wait;
+    mc_srv *srv, **active;
+    mc_pollfd *fds;
+
+    fds = (mc_pollfd *)R_alloc(mcon->nservers + 1,sizeof(mc_pollfd));
+    active = (mc_srv **)R_alloc(mcon->nservers + 1,sizeof(mc_srv *));
+    tried = (int *)R_alloc(mcon->nservers + 1,sizeof(int));
+
+    /* Connect to servers with work queued, failing those marked dead */
+    timed = (mcon->metrics && mcon->metrics->op != -1);
+    now = (timed)? monotonic_time() : 0;
+    for (i = 0; i < mcon->nservers; i++){
+	srv = mcon->servers[i];
+	tried[i] = FALSE;
+	if (srv->req.status != MC_PENDING) continue;
+	if (server_dead(srv)){
+	    fail_request(srv);
+	    continue;
+	}
+	tried[i] = TRUE;
+	if (timed){
+	    srv->timed = TRUE;
+	    srv->connected = (srv->scon == -1);
+	    srv->t_begin = srv->t_ready = now;
+	    srv->t_written = (srv->curseg == srv->nsegs)? now : 0;
+	    srv->t_first = srv->t_done = srv->t_unserialize = 0;
+	}
+	if (srv->scon == -1){
+	    if (resolve_srv(srv))
+		srv->scon = mc_SockConnectStart(&srv->addr,&mcon->sockopts,
+			&srv->connecting);
+	    if (srv->scon == -1){
+		fail_request(srv);
+		continue;
+	    }
+	}
+	arm_timeout(mcon,srv);
+    }
+
+    while (1){
+	now = monotonic_time();
+	wait = -1;
+	for (i = 0, n = 0; i < mcon->nservers; i++){
+	    srv = mcon->servers[i];
+	    if (srv->req.status != MC_PENDING) continue;
+
+	    /* Requests needing no reply are done once written */
+	    if (srv->curseg == srv->nsegs && srv->req.parse == NULL){
+		srv->req.status = MC_DONE;
+		srv->t_done = now;
+		continue;
+	    }
+
+	    fds[n].fd = srv->scon;
+	    fds[n].revents = 0;
+	    if (srv->connecting)
+		fds[n].events = MC_POLLOUT;
+	    else if (srv->curseg < srv->nsegs)
+		fds[n].events = MC_POLLIN|MC_POLLOUT; /* read replies as we write */
+	    else
+		fds[n].events = MC_POLLIN;
+	    active[n++] = srv;
+	    if (wait < 0 || srv->deadline - now < wait)
+		wait = srv->deadline - now;
+	}
+	if (n == 0) break;
+
+	/* Wait no longer than the first deadline, rounding up so as not
+	 * to wake just short of it
+	 */
+	nready = mc_SocketPoll(fds,n,(wait > 0)? timeout_ms(wait) : 0);
+	if (nready < 0){
+	    for (i = 0; i < n; i++) fail_request(active[i]);
+	    break;
+	}
+	now = monotonic_time();
+
+	for (i = 0; i < n; i++){
+	    srv = active[i];
+	    if (fds[i].revents == 0) continue;
+
+	    if (srv->connecting){
+		if (mc_SockConnectDone(srv->scon) != 0)
+		    fail_request(srv);
+		else {
+		    srv->connecting = 0;
+		    srv->t_ready = now;
+		    arm_timeout(mcon,srv);
+		}
+		continue;
+	    }
+
+	    if (fds[i].revents & MC_POLLOUT){
+		int res = send_srv(srv);
+		if (res < 0){
+		    fail_request(srv);
+		    continue;
+		}
+		if (res > 0){
+		    arm_timeout(mcon,srv);
+		    if (srv->curseg == srv->nsegs) srv->t_written = now;
+		}
+	    }
+
+	    if (fds[i].revents & (MC_POLLIN|MC_POLLERR)){
+		int res = recv_srv(srv);
+		if (res < 0){
+		    fail_request(srv);
+		    continue;
+		}
+		if (res > 0){
+		    arm_timeout(mcon,srv);
+		    if (srv->t_first == 0) srv->t_first = now;
+		}
+		if (res > 0 && srv->req.parse){
+		    srv->req.status = srv->req.parse(srv);
+		    if (srv->req.status == MC_FAILED) fail_request(srv);
+		    if (srv->req.status == MC_DONE && srv->timed)
+			srv->t_done = monotonic_time();
+		}
+	    }
+	}
+
+	/* Fail the servers that went a whole timeout without progress */
+	for (i = 0; i < n; i++){
+	    srv = active[i];
+	    if (srv->req.status == MC_PENDING && now >= srv->deadline)
+		fail_request(srv);
+	}
+    }
+
+    for (i = 0; i < mcon->nservers; i++){
+	if (!tried[i]) continue;
+	srv = mcon->servers[i];
+	if (srv->req.status == MC_DONE)
+	    server_ok(srv);
+	else if (srv->req.status == MC_FAILED)
+	    server_failed(mcon,srv);
+	metrics_request(mcon,srv);
+    }
+}
+
+/* Reads the replies to asynchronous requests, oldest first, until
+ * those of async have all been read, or every one if async is NULL.
+ * Each round takes the oldest request on every server that has one to
+ * read and runs them together, parsing first any replies already read
+ * while writing later requests.
+ */
+static void read_pending(mc_con *mcon, mc_async *async){
+    int i, n;
+    mc_srv *srv;
+    mc_pending *p;
+
+    io_reap(mcon,0);
+    do {
+	for (i = 0, n = 0; i < mcon->nservers; i++){
+	    srv = mcon->servers[i];
+	    reset_request(srv);
+	    for (p = srv->pending; p != NULL && async != NULL; p = p->next)
+		if (p->async == async) break;
+	    if (srv->pending == NULL || (async != NULL && p == NULL)) continue;
+
+	    if (srv->ibuf == NULL && (srv->ibuf = get_buf(mcon,1)) == NULL)
+		error("rmemcache: cannot allocate buffers");
+	    p = srv->reading = srv->pending;
+	    srv->pending = p->next;
+	    srv->npending--;
+	    n++;
+
+	    srv->req = p->req;
+	    srv->req.status = MC_PENDING;
+	    srv->read_timeout = timeout_ms(mcon->read_timeout);
+	    srv->write_timeout = timeout_ms(mcon->write_timeout);
+	    if (srv->ibuf->count > srv->ibuf->curpos){
+		srv->req.status = srv->req.parse(srv);
+		if (srv->req.status == MC_FAILED) fail_request(srv);
+	    }
+	}
+	if (n > 0) run_requests(mcon);
+
+	for (i = 0; i < mcon->nservers; i++){
+	    srv = mcon->servers[i];
+	    if (srv->reading == NULL) continue;
+	    finish_pending(srv->reading,srv->req.status == MC_DONE);
+	    srv->reading = NULL;
+	}
+    } while (n > 0);
+}
+
+/*
+ * Quiet batches
+ *
+ * With the quietBatch option the noreply commands of an ascii connection
+ * aren't written as they're issued but copied to a batch per server,
+ * srv->qbuf, which goes out in a single send once it holds quietBatch
+ * bytes, on mc_flush(), or before any other command to the connection,
+ * which so never overtakes them. A batch still unwritten when the
+ * connection is garbage collected is lost.
+ */
+
+/* Moves the noreply commands queued on srv to its quiet batch and counts
+ * the request done.
+ */
+static void batch_quiet(mc_con *mcon, mc_srv *srv){
+    mc_buf *buf;
+    mc_seg *seg;
+    int i;
+
+    if (srv->qbuf == NULL && (srv->qbuf = get_buf(mcon,1)) == NULL)
+	error("rmemcache: cannot allocate buffers");
+    buf = srv->qbuf;
+
+    for (i = 0; i < srv->nsegs; i++){
+	seg = &srv->segs[i];
+	resize_buf(buf, buf->count + seg->len);
+	memcpy(buf->buf + buf->count, srv->obuf->buf + seg->pos, seg->len);
+	buf->count += seg->len;
+    }
+    srv->nquiet += srv->req.n;
+    srv->nsegs = 0;
+    srv->req.status = MC_DONE;
+}
+
+/* Writes the quiet batch of every server having at least min bytes in
+ * one, and returns FALSE if a server failed, its batch being lost.
+ */
+static int flush_quiet(mc_con *mcon, size_t min){
+    int i, n, ok = TRUE, *flushed;
+    mc_srv *srv;
+    mc_buf *buf;
+
+    for (i = 0, n = 0; i < mcon->nservers; i++){
+	srv = mcon->servers[i];
+	if (srv->nquiet > 0 && srv->qbuf->count >= min) n++;
+    }
+    if (n == 0) return TRUE;
+
+    io_reap(mcon,0);
+    flushed = (int *)R_alloc(mcon->nservers + 1,sizeof(int));
+    for (i = 0; i < mcon->nservers; i++){
+	srv = mcon->servers[i];
+	flushed[i] = FALSE;
+	if (srv->nquiet == 0 || srv->qbuf->count < min){
+	    /* Only an interrupted request is still pending here */
+	    if (srv->req.status == MC_PENDING) reset_request(srv);
+	    continue;
+	}
+	if (!init_request(mcon,srv,NULL,R_NilValue,R_NilValue,NULL,0)){
+	    srv->nquiet = 0;
+	    put_buf(mcon,&srv->qbuf,&mcon->obuf_hwm);
+	    ok = FALSE;
+	    continue;
+	}
+
+	/* Write the batch in place of the obuf */
+	buf = srv->obuf;
+	srv->obuf = srv->qbuf;
+	srv->qbuf = buf;
+	queue_cmd(srv,0);
+	flushed[i] = TRUE;
+    }
+    run_requests(mcon);
+
+    for (i = 0; i < mcon->nservers; i++){
+	if (!flushed[i]) continue;
+	srv = mcon->servers[i];
+	if (srv->req.status != MC_DONE) ok = FALSE;
+	buf = srv->qbuf;
+	srv->qbuf = srv->obuf;
+	srv->obuf = buf;
+	srv->qbuf->count = 0;
+	put_buf(mcon,&srv->qbuf,&mcon->obuf_hwm);
+	srv->nquiet = 0;
+	srv->nsegs = srv->curseg = 0;
+	srv->segoff = 0;
+    }
+    return ok;
+}
+
+/* Adds the requests queued on every server to its quiet batch instead
+ * of running them, and writes the batches grown to quietBatch bytes.
+ * The requests of servers marked dead fail.
+ */
+static void quiet_requests(mc_con *mcon){
+    int i;
+    mc_srv *srv;
+
+    for (i = 0; i < mcon->nservers; i++){
+	srv = mcon->servers[i];
+	if (srv->req.status != MC_PENDING) continue;
+	if (server_dead(srv))
+	    srv->req.status = MC_FAILED;
+	else
+	    batch_quiet(mcon,srv);
+    }
+    flush_quiet(mcon,mcon->quiet_batch);
+}
+
+/*
+ * Background I/O
+ *
+ * With the ioThread option a connection runs a thread that writes the
+ * requests of asynchronous gets and stores, so that a large value goes
+ * out while R serializes the next one and mc_store_async() returns once
+ * its buffers are handed over. Serializing and unserializing stay on
+ * the R thread. A request's obuf and segments pass to the thread as an
+ * mc_iojob through a single producer, single consumer ring, and come
+ * back through another once written. While a server has jobs out, the
+ * thread also reads its replies into srv->ibuf, which the R thread
+ * leaves alone until it has taken every job back. Everything else
+ * waits for that first, in io_reap(), so only one thread ever uses a
+ * socket at a time.
+ */
+
+#ifdef MC_IOTHREAD
+
+typedef struct {
+    mc_srv *srv;
+    int scon;
+    mc_buf *obuf;
+    mc_seg *segs;
+    int nsegs;
+    int timeout; /* milliseconds to wait for the socket */
+    int failed;
+    size_t sent;
+    size_t received;
+} mc_iojob;
+
+struct mc_io {
+    pthread_t thread;
+    pthread_mutex_t lock; /* only to sleep on cond */
+    pthread_cond_t cond;  /* broadcast on a new job, a job done or stop */
+    mc_iojob *jobs[MC_IO_RING];
+    mc_iojob *done[MC_IO_RING];
+    unsigned int job_head;  /* written by the R thread */
+    unsigned int job_tail;  /* by the I/O thread */
+    unsigned int done_head; /* by the I/O thread */
+    unsigned int done_tail; /* by the R thread */
+    int queued;             /* jobs not yet taken back, R thread only */
+    int stop;
+};
+
+static void io_wake(mc_io *io){
+    pthread_mutex_lock(&io->lock);
+    pthread_cond_broadcast(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+}
+
+/* Reads what's come from job's server into its ibuf, growing it with
+ * realloc() rather than resize_buf(), which may raise an R error.
+ * Returns FALSE on error or if the server closed the connection.
+ */
+static int io_recv(mc_iojob *job){
+    mc_buf *buf = job->srv->ibuf;
+    unsigned char *grown;
+    int res;
+
+    compact_buf(buf);
+    if (buf->count == buf->size){
+	if ((grown = realloc(buf->buf,buf->size * 2)) == NULL) return FALSE;
+	buf->buf = grown;
+	buf->size *= 2;
+    }
+
+    res = mc_SockRead(job->scon,buf->buf + buf->count,buf->size - buf->count,0);
+    if (res == 0) return FALSE;
+    if (res < 0) return (-res == EAGAIN || -res == EINTR);
+
+    buf->count += res;
+    job->received += res;
+    return TRUE;
+}
+
+/* Writes job, failing it if the socket goes job->timeout without
+ * taking any of it. Runs on the I/O thread, so uses no R API.
+ */
+static void io_write(mc_iojob *job){
+    mc_pollfd fd;
+    int res, curseg = 0;
+    size_t segoff = 0;
+
+    /* After a failed job the stream is broken, the rest go unwritten */
+    if (__atomic_load_n(&job->srv->io_failed,__ATOMIC_ACQUIRE)){
+	job->failed = TRUE;
+	return;
+    }
+
+    while (curseg < job->nsegs){
+	res = send_segs(job->scon,job->obuf,job->segs,job->nsegs,&curseg,&segoff);
+	if (res > 0){
+	    job->sent += res;
+	    continue;
+	}
+	fd.fd = job->scon;
+	fd.events = MC_POLLIN|MC_POLLOUT;
+	fd.revents = 0;
+	if (res < 0 || mc_SocketPoll(&fd,1,job->timeout) <= 0 ||
+		((fd.revents & (MC_POLLIN|MC_POLLERR)) && !io_recv(job))){
+	    job->failed = TRUE;
+	    __atomic_store_n(&job->srv->io_failed,TRUE,__ATOMIC_RELEASE);
+	    return;
+	}
+    }
+}
+
+static void *io_main(void *arg){
+    mc_io *io = arg;
+    mc_iojob *job;
+    unsigned int tail;
+
+    while (1){
+	tail = io->job_tail;
+	if (tail == __atomic_load_n(&io->job_head,__ATOMIC_ACQUIRE)){
+	    pthread_mutex_lock(&io->lock);
+	    while (tail == __atomic_load_n(&io->job_head,__ATOMIC_ACQUIRE) && !io->stop)
+		pthread_cond_wait(&io->cond,&io->lock);
+	    pthread_mutex_unlock(&io->lock);
+	    if (tail == __atomic_load_n(&io->job_head,__ATOMIC_ACQUIRE)) break;
+	}
+	job = io->jobs[tail % MC_IO_RING];
+	io_write(job);
+	__atomic_store_n(&io->job_tail,tail + 1,__ATOMIC_RELEASE);
+
+	io->done[io->done_head % MC_IO_RING] = job;
+	__atomic_store_n(&io->done_head,io->done_head + 1,__ATOMIC_RELEASE);
+	io_wake(io);
+    }
+    return NULL;
+}
+
+/* Takes back the jobs the I/O thread is done with, waiting until no
+ * more than max are out: 0 to wait for all, MC_IO_RING never to wait.
+ * A server is dropped once it has no jobs out if one failed.
+ */
+static void io_reap(mc_con *mcon, int max){
+    mc_io *io = mcon->io;
+    mc_iojob *job;
+    mc_srv *srv;
+
+    if (io == NULL) return;
+    while (io->queued > 0){
+	if (io->done_tail == __atomic_load_n(&io->done_head,__ATOMIC_ACQUIRE)){
+	    if (io->queued <= max) return;
+	    pthread_mutex_lock(&io->lock);
+	    while (io->done_tail == __atomic_load_n(&io->done_head,__ATOMIC_ACQUIRE))
+		pthread_cond_wait(&io->cond,&io->lock);
+	    pthread_mutex_unlock(&io->lock);
+	}
+	job = io->done[io->done_tail % MC_IO_RING];
+	io->done_tail++;
+	io->queued--;
+
+	srv = job->srv;
+	srv->nwriting--;
+	srv->sent += job->sent;
+	srv->received += job->received;
+	put_buf(mcon,&job->obuf,&mcon->obuf_hwm);
+	free(job->segs);
+	free(job);
+
+	if (srv->nwriting == 0 && srv->io_failed){
+	    srv->io_failed = FALSE;
+	    close_srv(srv);
+	    server_failed(mcon,srv);
+	}
+    }
+}
+
+/* Hands the request queued on srv to the I/O thread, connecting first
+ * if need be. Returns FALSE if it couldn't, leaving it to be failed.
+ */
+static int io_submit(mc_con *mcon, mc_srv *srv){
+    mc_io *io = mcon->io;
+    mc_iojob *job;
+
+    if ((job = calloc(1,sizeof(mc_iojob))) == NULL){
+	io_reap(mcon,0);
+	return FALSE;
+    }
+    if (srv->scon == -1 && (server_dead(srv) || !resolve_srv(srv) ||
+		(srv->scon = mc_SockConnect(&srv->addr,&mcon->sockopts,
+		    timeout_ms(mcon->connect_timeout))) == -1)){
+	free(job);
+	if (!server_dead(srv)) server_failed(mcon,srv);
+	return FALSE;
+    }
+
+    io_reap(mcon,MC_IO_RING - 1);
+
+    job->srv = srv;
+    job->scon = srv->scon;
+    job->obuf = srv->obuf;
+    job->segs = srv->segs;
+    job->nsegs = srv->nsegs;
+    job->timeout = srv->write_timeout;
+    srv->obuf = NULL;
+    srv->segs = NULL;
+    srv->nsegs = srv->maxsegs = srv->curseg = 0;
+    srv->segoff = 0;
+    srv->nwriting++;
+
+    io->jobs[io->job_head % MC_IO_RING] = job;
+    __atomic_store_n(&io->job_head,io->job_head + 1,__ATOMIC_RELEASE);
+    io->queued++;
+    io_wake(io);
+    return TRUE;
+}
+
+/* Starts or stops the I/O thread as the ioThread option says. The
+ * thread blocks every signal, leaving them to R, and turns SIGPIPE
+ * into EPIPE.
+ */
+static void sync_io(mc_con *mcon){
+    mc_io *io = mcon->io;
+    sigset_t all, old;
+    int res;
+
+    if (mcon->io_on && io == NULL){
+	if ((io = calloc(1,sizeof(mc_io))) == NULL){
+	    warning("rmemcache: cannot allocate the I/O thread");
+	    mcon->io_on = FALSE;
+	    return;
+	}
+	pthread_mutex_init(&io->lock,NULL);
+	pthread_cond_init(&io->cond,NULL);
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK,&all,&old);
+	res = pthread_create(&io->thread,NULL,io_main,io);
+	pthread_sigmask(SIG_SETMASK,&old,NULL);
+	if (res != 0){
+	    pthread_cond_destroy(&io->cond);
+	    pthread_mutex_destroy(&io->lock);
+	    free(io);
+	    warning("rmemcache: cannot start the I/O thread");
+	    mcon->io_on = FALSE;
+	    return;
+	}
+	mcon->io = io;
+    } else if (!mcon->io_on && io != NULL){
+	io_reap(mcon,0);
+	pthread_mutex_lock(&io->lock);
+	io->stop = TRUE;
+	pthread_cond_broadcast(&io->cond);
+	pthread_mutex_unlock(&io->lock);
+	pthread_join(io->thread,NULL);
+	pthread_cond_destroy(&io->cond);
+	pthread_mutex_destroy(&io->lock);
+	free(io);
+	mcon->io = NULL;
+    }
+}
+
+#else
+
+static void io_reap(mc_con *mcon, int max){
+}
+
+static int io_submit(mc_con *mcon, mc_srv *srv){
+    return FALSE;
+}
+
+static void sync_io(mc_con *mcon){
+    if (mcon->io_on){
+	warning("rmemcache: this build has no I/O thread");
+	mcon->io_on = FALSE;
+    }
+}
+
+#endif
+
+/* Groups keys by server: on return the indexes of the keys hashed to
+ * server i are keyidx[start[i]] .. keyidx[start[i+1]-1]. Keys that
+ * couldn't be hashed are left out. keys[j] goes to the server of copy
+ * first + j / n of the key, so that n keys repeated nrep times go to
+ * all their copies.
+ */
+static void group_replicas(mc_con *mcon, SEXP keys, int n, int first,
+	int **keyidx, int **start){
+    int i, nkeys, *srvidx, *pos, *seen;
+
+    nkeys = LENGTH(keys);
+    srvidx = (int *)R_alloc(nkeys + 1,sizeof(int));
+    *keyidx = (int *)R_alloc(nkeys + 1,sizeof(int));
+    *start = (int *)R_alloc(mcon->nservers + 2,sizeof(int));
+    pos = (int *)R_alloc(mcon->nservers + 2,sizeof(int));
+    seen = (int *)R_alloc(mcon->nservers + 1,sizeof(int));
+
+    memset(*start,0,(mcon->nservers + 2) * sizeof(int));
+    for (i = 0; i < nkeys; i++){
+	srvidx[i] = replica_server(mcon,keys,i,first + i / n,seen);
+	if (srvidx[i] != -1) (*start)[srvidx[i] + 1]++;
+    }
+    for (i = 0; i < mcon->nservers; i++){
+	(*start)[i + 1] += (*start)[i];
+	pos[i] = (*start)[i];
+    }
+    for (i = 0; i < nkeys; i++)
+	if (srvidx[i] != -1) (*keyidx)[pos[srvidx[i]]++] = i;
+}
+
+/* Groups keys by the server hashing picks for them */
+static void group_keys(mc_con *mcon, SEXP keys, int **keyidx, int **start){
+    group_replicas(mcon,keys,LENGTH(keys),0,keyidx,start);
+}
+
+/* Reply parsers. Each consumes as many complete replies from srv->ibuf
+ * as are available and returns MC_PENDING when it needs more. Values
+ * larger than MC_STREAM_CHUNK are unserialized as soon as their header
+ * is in, reading the rest from the socket as they're decoded.
+ */
+static int parse_get_reply(mc_srv *srv){
+    mc_buf *buf = srv->ibuf;
+    mc_req *req = &srv->req;
+    char *line, *rkey;
+    const char *key;
+    size_t linelen, keylen, bytes, left;
+    int flags;
+
+    while (skip_reply(srv) && (line = peekline_buf(buf,&linelen)) != NULL){
+
+	/* END reached ? */
+	if (line_is(line,linelen,"END\r\n")){
+	    buf->curpos += linelen;
+	    return MC_DONE;
+	}
+
+	/* Server sent an error message */
+	if (error_occured(line,linelen)) return MC_FAILED;
+
+	/* VALUE */
+	if (!parse_value_line(line,&rkey,&keylen,&flags,&bytes))
+	    return MC_FAILED;
+
+	/* Wait for the whole data block plus "\r\n", unless it's large
+	 * enough to be streamed
+	 */
+	if (bytes <= MC_STREAM_CHUNK &&
+		buf->count - buf->curpos < linelen + bytes + 2){
+	    compact_buf(buf);
+	    resize_buf(buf,linelen + bytes + 2);
+	    return MC_PENDING;
+	}
+
+	/* Values arrive in the order requested, misses are skipped */
+	while (req->next < req->n){
+	    key = CHAR(STRING_ELT(req->keys,req->keyidx[req->next]));
+	    if (strlen(key) == keylen && strncmp(key,rkey,keylen) == 0) break;
+	    req->next++;
+	}
+	if (req->next == req->n) /* server sent a key we didn't ask for */
+	    return MC_FAILED;
+
+	buf->curpos += linelen;
+	if (bytes > MC_STREAM_CHUNK) resize_buf(buf,MC_STREAM_CHUNK);
+
+	take_value(srv,req->keyidx[req->next],bytes,flags,&left);
+
+	req->next++;
+
+	req->skip = left + 2;
+    }
+
+    return MC_PENDING;
+}
+
+static int parse_store_reply(mc_srv *srv){
+    mc_buf *buf = srv->ibuf;
+    mc_req *req = &srv->req;
+    char *line;
+    size_t linelen;
+
+    while ((line = peekline_buf(buf,&linelen)) != NULL){
+	buf->curpos += linelen;
+
+	/* Success! */
+	if (line_is(line,linelen,"STORED\r\n"))
+	    LOGICAL(req->result)[req->keyidx[req->next]] = TRUE;
+
+	/* Otherwise conditions for add or replace weren't met, key is
+	 * in a delete queue, or server sent an error message
+	 */
+	else
+	    error_occured(line,linelen);
+
+	if (++req->next == req->n) return MC_DONE;
+    }
+
+    return MC_PENDING;
+}
+
+static int parse_delete_reply(mc_srv *srv){
+    mc_buf *buf = srv->ibuf;
+    mc_req *req = &srv->req;
+    char *line;
+    size_t linelen;
+
+    while ((line = peekline_buf(buf,&linelen)) != NULL){
+	buf->curpos += linelen;
+
+	if (line_is(line,linelen,"DELETED\r\n"))
+	    LOGICAL(req->result)[req->keyidx[req->next]] = TRUE;
+	else if (line_is(line,linelen,"NOT_FOUND\r\n"))
+	    LOGICAL(req->result)[req->keyidx[req->next]] = FALSE;
+	else
+	    error_occured(line,linelen);
+
+	if (++req->next == req->n) return MC_DONE;
+    }
+
+    return MC_PENDING;
+}
+
+static int parse_counter_reply(mc_srv *srv){
+    mc_buf *buf = srv->ibuf;
+    mc_req *req = &srv->req;
+    char *line;
+    size_t linelen;
+
+    while ((line = peekline_buf(buf,&linelen)) != NULL){
+	buf->curpos += linelen;
+
+	if (line[0] >= '0' && line[0] <= '9')
+	    REAL(req->result)[req->keyidx[req->next]] =
+		(double)strtoull(line,NULL,10);
+	else if (!line_is(line,linelen,"NOT_FOUND\r\n"))
+	    error_occured(line,linelen);
+
+	if (++req->next == req->n) return MC_DONE;
+    }
+
+    return MC_PENDING;
+}
+
+/* Binary protocol reply parsers. Quiet commands are answered in order,
+ * so when a store or delete replies with a failure, every key before it
+ * in the request succeeded.
+ */
+static int parse_bin_get_reply(mc_srv *srv){
+    mc_buf *buf = srv->ibuf;
+    mc_req *req = &srv->req;
+    unsigned char *hdr;
+    size_t bodylen, skip, left;
+    unsigned int opaque;
+    int flags;
+
+    while (skip_reply(srv) &&
+	    (hdr = peekresponse_buf(buf,&bodylen,TRUE)) != NULL){
+	if (hdr[0] != MC_BIN_RES_MAGIC) return MC_FAILED;
+
+	opaque = get32(hdr + 12);
+
+	if (hdr[1] == MC_BIN_NOOP){
+	    buf->curpos += MC_BIN_HDR_LEN + bodylen;
+	    return MC_DONE;
+	}
+
+	if (hdr[1] != MC_BIN_GETQ || opaque >= (unsigned int)req->n)
+	    return MC_FAILED;
+
+	if (get16(hdr + 6) != 0){
+	    bin_error(hdr,bodylen);
+	    buf->curpos += MC_BIN_HDR_LEN + bodylen;
+	    continue;
+	}
+
+	flags = (hdr[4] >= 4)? get32(hdr + MC_BIN_HDR_LEN) : 0;
+	skip = MC_BIN_HDR_LEN + hdr[4] + get16(hdr + 2);
+	buf->curpos += skip;
+	if (bodylen > MC_STREAM_CHUNK) resize_buf(buf,MC_STREAM_CHUNK);
+
+	take_value(srv,req->keyidx[opaque],MC_BIN_HDR_LEN + bodylen - skip,flags,&left);
+
+	req->skip = left;
+    }
+
+    return MC_PENDING;
+}
+
+static int parse_bin_store_reply(mc_srv *srv){
+    mc_buf *buf = srv->ibuf;
+    mc_req *req = &srv->req;
+    unsigned char *hdr;
+    size_t bodylen;
+    unsigned int opaque, status;
+
+    while ((hdr = peekresponse_buf(buf,&bodylen,FALSE)) != NULL){
+	if (hdr[0] != MC_BIN_RES_MAGIC) return MC_FAILED;
+
+	opaque = (hdr[1] == MC_BIN_NOOP)? req->n : get32(hdr + 12);
+	if (opaque > (unsigned int)req->n || opaque < (unsigned int)req->next)
+	    return MC_FAILED;
+
+	for (; req->next < (int)opaque; req->next++)
+	    LOGICAL(req->result)[req->keyidx[req->next]] = TRUE;
+
+	if (hdr[1] == MC_BIN_NOOP){
+	    buf->curpos += MC_BIN_HDR_LEN + bodylen;
+	    return MC_DONE;
+	}
+
+	/* Conditions for add or replace weren't met, or an error */
+	status = get16(hdr + 6);
+	if (status != MC_BIN_KEY_EEXISTS && status != MC_BIN_KEY_ENOENT &&
+		status != MC_BIN_NOT_STORED)
+	    bin_error(hdr,bodylen);
+	req->next++;
+
+	buf->curpos += MC_BIN_HDR_LEN + bodylen;
+    }
+
+    return MC_PENDING;
+}
+
+static int parse_bin_delete_reply(mc_srv *srv){
+    mc_buf *buf = srv->ibuf;
+    mc_req *req = &srv->req;
+    unsigned char *hdr;
+    size_t bodylen;
+    unsigned int opaque;
+
+    while ((hdr = peekresponse_buf(buf,&bodylen,FALSE)) != NULL){
+	if (hdr[0] != MC_BIN_RES_MAGIC) return MC_FAILED;
+
+	opaque = (hdr[1] == MC_BIN_NOOP)? req->n : get32(hdr + 12);
+	if (opaque > (unsigned int)req->n || opaque < (unsigned int)req->next)
+	    return MC_FAILED;
+
+	for (; req->next < (int)opaque; req->next++)
+	    LOGICAL(req->result)[req->keyidx[req->next]] = TRUE;
+
+	if (hdr[1] == MC_BIN_NOOP){
+	    buf->curpos += MC_BIN_HDR_LEN + bodylen;
+	    return MC_DONE;
+	}
+
+	if (get16(hdr + 6) == MC_BIN_KEY_ENOENT)
+	    LOGICAL(req->result)[req->keyidx[req->next]] = FALSE;
+	else
+	    bin_error(hdr,bodylen);
+	req->next++;
+
+	buf->curpos += MC_BIN_HDR_LEN + bodylen;
+    }
+
+    return MC_PENDING;
+}
+
+static int parse_bin_counter_reply(mc_srv *srv){
+    mc_buf *buf = srv->ibuf;
+    mc_req *req = &srv->req;
+    unsigned char *hdr;
+    size_t bodylen;
+    unsigned int opaque, status;
+
+    while ((hdr = peekresponse_buf(buf,&bodylen,FALSE)) != NULL){
+	if (hdr[0] != MC_BIN_RES_MAGIC) return MC_FAILED;
+
+	if (hdr[1] == MC_BIN_NOOP){
+	    buf->curpos += MC_BIN_HDR_LEN + bodylen;
+	    return MC_DONE;
+	}
+
+	opaque = get32(hdr + 12);
+	if ((hdr[1] != MC_BIN_INCREMENT && hdr[1] != MC_BIN_DECREMENT) ||
+		opaque >= (unsigned int)req->n)
+	    return MC_FAILED;
+
+	status = get16(hdr + 6);
+	if (status == 0 && bodylen == 8)
+	    REAL(req->result)[req->keyidx[opaque]] =
+		(double)get64(hdr + MC_BIN_HDR_LEN);
+	else if (status != MC_BIN_KEY_ENOENT)
+	    bin_error(hdr,bodylen);
+
+	buf->curpos += MC_BIN_HDR_LEN + bodylen;
+    }
+
+    return MC_PENDING;
+}
+
+/* Queues a get of keys on their servers, for the values to be set in
+ * result, or copied to chunks if set.
+ */
+static void queue_gets(mc_con *mcon, SEXP keys, int replica, SEXP result,
+	mc_chunkdst *chunks){
+    int i, *keyidx, *start;
+    mc_srv *srv;
+
+    group_replicas(mcon,keys,LENGTH(keys),replica,&keyidx,&start);
+
+    reset_requests(mcon);
+    for (i = 0; i < mcon->nservers; i++){
+	if (start[i] == start[i+1]) continue;
+	srv = mcon->servers[i];
+
+	if (!init_request(mcon,srv,(mcon->protocol == MC_PROTO_BINARY)?
+		    parse_bin_get_reply : parse_get_reply,keys,result,
+		    keyidx + start[i],start[i+1] - start[i]))
+	    continue;
+	srv->req.chunks = chunks;
+
+	if (mcon->protocol == MC_PROTO_BINARY)
+	    append_bin_get_cmd(srv->obuf,keys,keyidx + start[i],start[i+1] - start[i]);
+	else
+	    append_get_cmd(srv->obuf,keys,keyidx + start[i],start[i+1] - start[i]);
+	queue_cmd(srv,0);
+    }
+}
+
+/* Returns the keys of the n chunks of the value stored under key as id */
+static SEXP chunk_keys(const char *key, const char *id, int n){
+    SEXP ckeys;
+    char *ckey;
+    int i;
+
+    PROTECT(ckeys = allocVector(STRSXP,n));
+    ckey = R_alloc(strlen(key) + strlen(id) + 24,1);
+    for (i = 0; i < n; i++){
+	sprintf(ckey,"%s:%s:%d",key,id,i);
+	SET_STRING_ELT(ckeys,i,mkChar(ckey));
+    }
+    UNPROTECT(1);
+    return ckeys;
+}
+
+/* Parses a manifest, returning FALSE if it's malformed. id must hold
+ * MC_MANIFEST_MAX bytes.
+ */
+static int parse_manifest(const char *manifest, char *id, int *n,
+	int *chunksize, size_t *size, int *flags){
+    unsigned long len;
+
+    if (sscanf(manifest,"%127s %d %d %lu %d",id,n,chunksize,&len,flags) != 5)
+	return FALSE;
+    *size = len;
+
+    return (*n > 0 && *chunksize > 0 &&
+	    (size_t)(*n - 1) * *chunksize < *size &&
+	    *size <= (size_t)*n * *chunksize);
+}
+
+/* Replaces the manifests that get_values() left in value with the
+ * values reassembled from their chunks, which are fetched for all of
+ * them at once straight into place. A value missing a chunk, e.g. one
+ * that was evicted, is NULL.
+ */
+static void get_chunked(mc_con *mcon, SEXP keys, SEXP value){
+    int i, j, k, chunksize, nchunks = 0, *first, *nc, *flags;
+    size_t *size, left;
+    char id[MC_MANIFEST_MAX];
+    mc_chunkdst *chunks;
+    mc_buf raw;
+    SEXP elt, ckeys, parts, raws;
+
+    first = (int *)R_alloc(LENGTH(value) + 1,sizeof(int));
+    nc = (int *)R_alloc(LENGTH(value) + 1,sizeof(int));
+    flags = (int *)R_alloc(LENGTH(value) + 1,sizeof(int));
+    size = (size_t *)R_alloc(LENGTH(value) + 1,sizeof(size_t));
+
+    for (i = 0; i < LENGTH(value); i++){
+	first[i] = -1;
+	elt = VECTOR_ELT(value,i);
+	if (TYPEOF(elt) != CHARSXP) continue;
+	if (!parse_manifest(CHAR(elt),id,&nc[i],&chunksize,&size[i],&flags[i])){
+	    SET_VECTOR_ELT(value,i,R_NilValue);
+	    continue;
+	}
+	first[i] = nchunks;
+	nchunks += nc[i];
+    }
+    if (nchunks == 0) return;
+
+    PROTECT(ckeys = allocVector(STRSXP,nchunks));
+    PROTECT(raws = allocVector(VECSXP,LENGTH(value)));
+    chunks = (mc_chunkdst *)R_alloc(nchunks,sizeof(mc_chunkdst));
+
+    for (i = 0; i < LENGTH(value); i++){
+	if (first[i] == -1) continue;
+	parse_manifest(CHAR(VECTOR_ELT(value,i)),id,&nc[i],&chunksize,&size[i],&flags[i]);
+	SET_VECTOR_ELT(raws,i,allocVector(RAWSXP,size[i]));
+	parts = chunk_keys(CHAR(STRING_ELT(keys,i)),id,nc[i]);
+	for (j = 0; j < nc[i]; j++){
+	    k = first[i] + j;
+	    SET_STRING_ELT(ckeys,k,STRING_ELT(parts,j));
+	    chunks[k].dst = RAW(VECTOR_ELT(raws,i)) + (size_t)j * chunksize;
+	    chunks[k].len = (j < nc[i] - 1)? (size_t)chunksize : size[i] - (size_t)j * chunksize;
+	    chunks[k].got = FALSE;
+	}
+	SET_VECTOR_ELT(value,i,R_NilValue);
+    }
+
+    queue_gets(mcon,ckeys,0,R_NilValue,chunks);
+    run_requests(mcon);
+
+    for (i = 0; i < LENGTH(value); i++){
+	if (first[i] == -1) continue;
+	for (k = first[i]; k < first[i] + nc[i] && chunks[k].got; k++);
+	if (k < first[i] + nc[i]) continue; /* a chunk is missing */
+
+	raw.buf = RAW(VECTOR_ELT(raws,i));
+	raw.size = raw.count = size[i];
+	raw.curpos = 0;
+	SET_VECTOR_ELT(value,i,unserialize_value(&raw,NULL,size[i],flags[i],&left));
+	SET_VECTOR_ELT(raws,i,R_NilValue);
+    }
+
+    UNPROTECT(2);
+}
+
+/* Estimates the memory taken by value, counting vector data and list
+ * elements but not attributes.
+ */
+static size_t near_size(SEXP value){
+    size_t size = 56; /* header */
+    int i;
+
+    switch (TYPEOF(value)){
+	case RAWSXP:
+	    size += LENGTH(value);
+	    break;
+	case LGLSXP:
+	case INTSXP:
+	    size += LENGTH(value) * sizeof(int);
+	    break;
+	case REALSXP:
+	    size += LENGTH(value) * sizeof(double);
+	    break;
+	case CPLXSXP:
+	    size += LENGTH(value) * sizeof(Rcomplex);
+	    break;
+	case STRSXP:
+	    for (i = 0; i < LENGTH(value); i++)
+		size += sizeof(SEXP) + 56 + LENGTH(STRING_ELT(value,i));
+	    break;
+	case VECSXP:
+	    for (i = 0; i < LENGTH(value); i++)
+		size += sizeof(SEXP) + near_size(VECTOR_ELT(value,i));
+	    break;
+    }
+    return size;
+}
+
+/* Returns the link to the entry for key, which is NULL if there isn't one */
+static mc_near_entry **find_near(mc_near *near, const char *key, unsigned int hash){
+    mc_near_entry **link = &near->buckets[hash & (near->nbuckets - 1)];
+
+    while (*link && ((*link)->hash != hash || strcmp((*link)->key,key) != 0))
+	link = &(*link)->chain;
+    return link;
+}
+
+static void unlink_lru(mc_near *near, mc_near_entry *e){
+    if (e->prev) e->prev->next = e->next; else near->head = e->next;
+    if (e->next) e->next->prev = e->prev; else near->tail = e->prev;
+}
+
+static void push_lru(mc_near *near, mc_near_entry *e){
+    e->prev = NULL;
+    e->next = near->head;
+    if (near->head) near->head->prev = e; else near->tail = e;
+    near->head = e;
+}
+
+/* Removes the entry *link points to */
+static void remove_near(mc_near *near, mc_near_entry **link){
+    mc_near_entry *e = *link;
+
+    *link = e->chain;
+    unlink_lru(near,e);
+    near->size -= e->size;
+    near->count--;
+    R_ReleaseObject(e->value);
+    free(e->key);
+    free(e);
+}
+
+static void evict_near(mc_near *near){
+    mc_near_entry *e;
+
+    while (near->size > near->budget && (e = near->tail) != NULL){
+	remove_near(near,find_near(near,e->key,e->hash));
+	near->evictions++;
+    }
+}
+
+/* Returns the cached value of key, or NULL on a miss */
+static SEXP get_near(mc_con *mcon, const char *key){
+    mc_near *near = &mcon->near;
+    mc_near_entry **link;
+    unsigned int hash;
+
+    if (near->count == 0){
+	near->misses++;
+	return NULL;
+    }
+
+    hash = mc_hash_fnv1a_32(key,strlen(key));
+    link = find_near(near,key,hash);
+    if (*link == NULL || ((*link)->expires > 0 && (*link)->expires < monotonic_time())){
+	if (*link) remove_near(near,link);
+	near->misses++;
+	return NULL;
+    }
+
+    near->hits++;
+    unlink_lru(near,*link);
+    push_lru(near,*link);
+    return (*link)->value;
+}
+
+/* Caches value as that of key. Values too large for the budget, and
+ * NULL for keys not found, aren't cached.
+ */
+static void put_near(mc_con *mcon, const char *key, SEXP value){
+    mc_near *near = &mcon->near;
+    mc_near_entry **link, *e, **buckets, *next;
+    unsigned int hash;
+    size_t size;
+    int i, n;
+
+    if (near->budget == 0 || value == R_NilValue) return;
+    if ((size = near_size(value) + strlen(key)) > near->budget) return;
+
+    if (near->count >= near->nbuckets){
+	n = (near->nbuckets > 0)? 2 * near->nbuckets : 64;
+	if ((buckets = calloc(n,sizeof(mc_near_entry *))) == NULL) return;
+	for (i = 0; i < near->nbuckets; i++)
+	    for (e = near->buckets[i]; e; e = next){
+		next = e->chain;
+		e->chain = buckets[e->hash & (n - 1)];
+		buckets[e->hash & (n - 1)] = e;
+	    }
+	free(near->buckets);
+	near->buckets = buckets;
+	near->nbuckets = n;
+    }
+
+    hash = mc_hash_fnv1a_32(key,strlen(key));
+    link = find_near(near,key,hash);
+    if (*link) remove_near(near,link);
+
+    if ((e = calloc(1,sizeof(mc_near_entry))) == NULL) return;
+    if ((e->key = strdup(key)) == NULL){
+	free(e);
+	return;
+    }
+    e->hash = hash;
+    e->value = value;
+    e->size = size;
+    e->expires = (near->ttl > 0)? monotonic_time() + near->ttl : 0;
+
+    /* The cached value is handed out again, so R mustn't modify it */
+    MARK_NOT_MUTABLE(value);
+    R_PreserveObject(value);
+
+    *link = e;
+    push_lru(near,e);
+    near->size += size;
+    near->count++;
+    evict_near(near);
+}
+
+/* Drops the cached values of keys */
+static void drop_near(mc_con *mcon, SEXP keys){
+    mc_near *near = &mcon->near;
+    mc_near_entry **link;
+    const char *key;
+    int i;
+
+    near->invalidations++;
+    for (i = 0; i < LENGTH(keys) && near->count > 0; i++){
+	key = CHAR(STRING_ELT(keys,i));
+	link = find_near(near,key,mc_hash_fnv1a_32(key,strlen(key)));
+	if (*link) remove_near(near,link);
+    }
+}
+
+static void clear_near(mc_con *mcon){
+    mc_near *near = &mcon->near;
+
+    near->invalidations++;
+    while (near->head)
+	remove_near(near,find_near(near,near->head->key,near->head->hash));
+    free(near->buckets);
+    near->buckets = NULL;
+    near->nbuckets = 0;
+}
+
+/* Fetches the keys whose value is still NULL from their other copies,
+ * one copy after the other.
+ */
+static void failover_values(mc_con *mcon, SEXP keys, SEXP value){
+    int i, n, r, nrep = replica_count(mcon), *idx;
+    SEXP missed, got;
+
+    idx = (int *)R_alloc(LENGTH(keys) + 1,sizeof(int));
+    for (r = 1; r < nrep; r++){
+	for (i = 0, n = 0; i < LENGTH(keys); i++)
+	    if (VECTOR_ELT(value,i) == R_NilValue) idx[n++] = i;
+	if (n == 0) break;
+
+	PROTECT(missed = allocVector(STRSXP,n));
+	PROTECT(got = allocVector(VECSXP,n));
+	for (i = 0; i < n; i++)
+	    SET_STRING_ELT(missed,i,STRING_ELT(keys,idx[i]));
+
+	queue_gets(mcon,missed,r,got,NULL);
+	run_requests(mcon);
+	get_chunked(mcon,missed,got);
+
+	for (i = 0; i < n; i++)
+	    SET_VECTOR_ELT(value,idx[i],VECTOR_ELT(got,i));
+	UNPROTECT(2);
+    }
+}
+
+/* Gets the values of keys from the servers into value, trying each
+ * replica in turn for the keys still missing.
+ */
+static void fetch_values(mc_con *mcon, SEXP keys, SEXP value){
+    queue_gets(mcon,keys,0,value,NULL);
+    run_requests(mcon);
+    get_chunked(mcon,keys,value);
+    failover_values(mcon,keys,value);
+    release_iobufs(mcon);
+}
+
+/* Returns a list of the values of keys, taken from the near cache when
+ * it's on and fetched from the servers otherwise.
+ */
+static SEXP get_values(mc_con *mcon, SEXP keys){
+    int i, n, *idx;
+    double began = metrics_begin(mcon,MC_OP_GET);
+    SEXP value, cached, missed, got;
+
+    PROTECT(value = allocVector(VECSXP,LENGTH(keys)));
+    setAttrib(value,R_NamesSymbol,keys);
+
+    if (mcon->near.budget == 0){
+	fetch_values(mcon,keys,value);
+	metrics_end(mcon,began,LENGTH(keys));
+	UNPROTECT(1);
+	return value;
+    }
+
+    idx = (int *)R_alloc(LENGTH(keys) + 1,sizeof(int));
+    for (i = 0, n = 0; i < LENGTH(keys); i++){
+	if ((cached = get_near(mcon,CHAR(STRING_ELT(keys,i)))) != NULL)
+	    SET_VECTOR_ELT(value,i,cached);
+	else
+	    idx[n++] = i;
+    }
+
+    if (n > 0){
+	PROTECT(missed = allocVector(STRSXP,n));
+	PROTECT(got = allocVector(VECSXP,n));
+	for (i = 0; i < n; i++)
+	    SET_STRING_ELT(missed,i,STRING_ELT(keys,idx[i]));
+
+	fetch_values(mcon,missed,got);
+
+	for (i = 0; i < n; i++){
+	    SET_VECTOR_ELT(value,idx[i],VECTOR_ELT(got,i));
+	    put_near(mcon,CHAR(STRING_ELT(missed,i)),VECTOR_ELT(got,i));
+	}
+	UNPROTECT(2);
+    }
+
+    metrics_end(mcon,began,LENGTH(keys));
+    UNPROTECT(1);
+    return value;
+}
+
+/* Stores the key at keyidx[0] on srv, whose value serialized to size
+ * bytes with flags but was too large to buffer. It is serialized again
+ * straight to the socket, MC_STREAM_CHUNK bytes at a time, after which
+ * the reply is read by run_requests() as usual. If the second pass
+ * doesn't come to size bytes, srv is closed mid-value. Returns FALSE if
+ * srv failed.
+ */
+static int stream_store(mc_con *mcon, mc_srv *srv, SEXP keys, SEXP value,
+	SEXP stored, int *keyidx, const char *cmd, int opcode, int exptime,
+	int flags, size_t size){
+    mc_buf *buf;
+    mc_ostream os;
+    const char *key = CHAR(STRING_ELT(keys,keyidx[0]));
+    size_t hdrpos, len;
+
+    if (!init_request(mcon,srv,(mcon->protocol == MC_PROTO_BINARY)?
+		parse_bin_store_reply : parse_store_reply,keys,stored,keyidx,1))
+	return TRUE;
+    buf = srv->obuf;
+
+    if (server_dead(srv)){
+	fail_request(srv);
+	return FALSE;
+    }
+    if (srv->scon == -1 && (!resolve_srv(srv) ||
+		(srv->scon = mc_SockConnect(&srv->addr,&mcon->sockopts,
+		    timeout_ms(mcon->connect_timeout))) == -1)){
+	fail_request(srv);
+	server_failed(mcon,srv);
+	return FALSE;
+    }
+
+    if (mcon->protocol == MC_PROTO_BINARY){
+	len = strlen(key);
+	hdrpos = append_bin_store_header(buf,opcode,key,exptime,0);
+	put32(buf->buf + hdrpos + 8,8 + len + size);
+	put32(buf->buf + hdrpos + MC_BIN_HDR_LEN,flags);
+    } else {
+	hdrpos = append_store_header(buf,cmd,key);
+	sprintf((char *)buf->buf + hdrpos + strlen((char *)buf->buf + hdrpos),
+		"%d %d %lu\r\n",flags,exptime,(unsigned long)size);
+	buf->count = hdrpos + strlen((char *)buf->buf + hdrpos);
+    }
+
+    init_ostream(&os,mcon,buf);
+    os.srv = srv;
+    serialize_ostream(&os,value);
+
+    /* The header promised size bytes; anything else leaves the server
+     * reading the wrong requests.
+     */
+    if (os.measured + buf->count - os.start != size){
+	warning("rmemcache: value changed size while being streamed");
+	buf->count = 0;
+	fail_request(srv);
+	return FALSE;
+    }
+
+    if (mcon->protocol == MC_PROTO_BINARY){
+	append_bin_noop(buf,1);
+    } else {
+	resize_buf(buf, buf->count + 2);
+	memcpy(buf->buf + buf->count,"\r\n",2);
+	buf->count += 2;
+    }
+    if (os.failed || mc_SockWrite(srv->scon,buf->buf,buf->count,
+		srv->write_timeout) != buf->count){
+	fail_request(srv);
+	server_failed(mcon,srv);
+	return FALSE;
+    }
+    srv->sent += buf->count;
+    buf->count = 0;
+
+    run_requests(mcon);
+    return (srv->req.status != MC_FAILED);
+}
+
+static SEXP delete_values(mc_con *mcon, SEXP keys, int noreply);
+
+/* Stores the key at keyidx[0] with cmd, its value having serialized to
+ * size bytes with flags, in chunks. The value is serialized again to
+ * mcon->sbuf, each chunk being queued on its server as soon as it's
+ * complete, and the chunks are sent together. The manifest is stored on
+ * srv only once every chunk has been, so the key never names a value
+ * that is incomplete, and the chunks are deleted if it isn't stored.
+ * Returns FALSE if srv failed.
+ */
+static int chunk_store(mc_con *mcon, mc_srv *srv, SEXP keys, SEXP value,
+	SEXP stored, int *keyidx, const char *cmd, int opcode, int exptime,
+	int flags, size_t size){
+    static unsigned int nstored;
+    mc_chunker ck;
+    mc_ostream os;
+    mc_srv *csrv;
+    SEXP ckeys, cstored;
+    int i, k, n, ok, *ckeyidx, *start;
+    char id[64], manifest[MC_MANIFEST_MAX];
+    const char *key = CHAR(STRING_ELT(keys,keyidx[0]));
+    size_t hdrpos;
+
+    n = (size + mcon->chunksize - 1) / mcon->chunksize;
+    sprintf(id,"%lx.%x.%x",(unsigned long)time(NULL),(unsigned int)getpid(),
+	    nstored++);
+    PROTECT(ckeys = chunk_keys(key,id,n));
+    PROTECT(cstored = allocVector(LGLSXP,n));
+    for (i = 0; i < n; i++) LOGICAL(cstored)[i] = FALSE;
+
+    group_keys(mcon,ckeys,&ckeyidx,&start);
+    if (start[mcon->nservers] != n){ /* a chunk key couldn't be hashed */
+	UNPROTECT(2);
+	return TRUE;
+    }
+
+    memset(&ck,0,sizeof(mc_chunker));
+    ck.mcon = mcon;
+    ck.keys = ckeys;
+    ck.exptime = exptime;
+    ck.size = mcon->chunksize;
+    ck.srvidx = (int *)R_alloc(n,sizeof(int));
+    ck.nqueued = (int *)R_alloc(mcon->nservers + 1,sizeof(int));
+    for (i = 0; i < mcon->nservers; i++){
+	ck.nqueued[i] = 0;
+	if (start[i] == start[i+1]) continue;
+	if (!init_request(mcon,mcon->servers[i],(mcon->protocol == MC_PROTO_BINARY)?
+		    parse_bin_store_reply : parse_store_reply,ckeys,cstored,
+		    ckeyidx + start[i],start[i+1] - start[i]))
+	    error("rmemcache: cannot allocate buffers");
+	for (k = start[i]; k < start[i+1]; k++) ck.srvidx[ckeyidx[k]] = i;
+    }
+
+    if (mcon->sbuf == NULL && (mcon->sbuf = get_buf(mcon,mcon->chunksize)) == NULL)
+	error("rmemcache: cannot allocate buffers");
+    mcon->sbuf->count = 0;
+    init_ostream(&os,mcon,mcon->sbuf);
+    os.chunker = &ck;
+    serialize_ostream(&os,value);
+    flush_chunks(&os,TRUE);
+    if (ck.next != n)
+	error("rmemcache: value changed size while being chunked");
+
+    if (mcon->protocol == MC_PROTO_BINARY){
+	for (i = 0; i < mcon->nservers; i++){
+	    if (start[i] == start[i+1]) continue;
+	    csrv = mcon->servers[i];
+	    hdrpos = csrv->obuf->count;
+	    append_bin_noop(csrv->obuf,ck.nqueued[i]);
+	    queue_cmd(csrv,hdrpos);
+	}
+    }
+    run_requests(mcon);
+    ok = (srv->req.status != MC_FAILED);
+
+    for (i = 0; i < n && LOGICAL(cstored)[i] == TRUE; i++);
+    if (i == n && init_request(mcon,srv,(mcon->protocol == MC_PROTO_BINARY)?
+		parse_bin_store_reply : parse_store_reply,keys,stored,keyidx,1)){
+	sprintf(manifest,"%s %d %d %lu %d",id,n,mcon->chunksize,
+		(unsigned long)size,flags);
+	queue_raw_store(mcon,srv,cmd,opcode,key,MC_FLAG_CHUNKED,exptime,
+		manifest,strlen(manifest),0);
+	if (mcon->protocol == MC_PROTO_BINARY){
+	    hdrpos = srv->obuf->count;
+	    append_bin_noop(srv->obuf,1);
+	    queue_cmd(srv,hdrpos);
+	}
+	run_requests(mcon);
+	ok = (srv->req.status != MC_FAILED);
+    }
+
+    if (LOGICAL(stored)[keyidx[0]] != TRUE)
+	delete_values(mcon,ckeys,TRUE);
+
+    UNPROTECT(2);
+    return ok;
+}
+
+/* Returns a logical vector, TRUE for each key stored. Values are
+ * serialized and queued MC_STORE_BATCH at a time per server, and the
+ * servers' batches are run concurrently. A value too large to buffer
+ * ends its server's batch and is streamed, or chunked, on its own after
+ * it.
+ *
+ * With noreply, the ascii commands ask for no reply and a key is TRUE
+ * once written, or once added to the quiet batch in quiet mode. Values
+ * streamed or chunked still have their replies read, as does every
+ * binary command, whose quiet stores reply to failures.
+ */
+static SEXP store_values(mc_con *mcon, SEXP keys, SEXP values, SEXP exptime, SEXP cmd,
+	int noreply){
+    int i, k, m, more, nexptime, opcode = 0, flags, queued, ok, quiet;
+    int *keyidx, *start, *pos, *first, *bigflags;
+    int nkeys = LENGTH(keys), nrep = replica_count(mcon);
+    size_t hdrpos, size, *bigsize;
+    double began = metrics_begin(mcon,MC_OP_STORE), serialized;
+    mc_srv *srv;
+    SEXP stored;
+
+    if (mcon->protocol == MC_PROTO_BINARY){
+	opcode = bin_store_opcode(CHAR(STRING_ELT(cmd,0)));
+	noreply = FALSE;
+    }
+    quiet = (noreply && mcon->quiet_batch > 0);
+
+    drop_near(mcon,keys);
+
+    /* Store the copies of each key together */
+    PROTECT(keys = replicate_vector(keys,nkeys,nrep));
+    PROTECT(values = replicate_vector(values,nkeys,nrep));
+    PROTECT(exptime = replicate_vector(exptime,nkeys,nrep));
+    nexptime = LENGTH(exptime);
+
+    PROTECT(stored = allocVector(LGLSXP,LENGTH(keys)));
+    for (i = 0; i < LENGTH(keys); i++) LOGICAL(stored)[i] = FALSE;
+
+    group_replicas(mcon,keys,nkeys,0,&keyidx,&start);
+    pos = (int *)R_alloc(mcon->nservers + 1,sizeof(int));
+    first = (int *)R_alloc(mcon->nservers + 1,sizeof(int));
+    bigflags = (int *)R_alloc(mcon->nservers + 1,sizeof(int));
+    bigsize = (size_t *)R_alloc(mcon->nservers + 1,sizeof(size_t));
+    for (i = 0; i < mcon->nservers; i++){
+	pos[i] = start[i];
+	bigsize[i] = 0;
+    }
+
+    do {
+	more = FALSE;
+	if (quiet)
+	    begin_requests(mcon);
+	else
+	    reset_requests(mcon);
+	serialized = (began)? monotonic_time() : 0;
+	for (i = 0; i < mcon->nservers; i++){
+	    first[i] = pos[i];
+	    if (pos[i] == start[i+1]) continue;
+	    srv = mcon->servers[i];
+
+	    m = (start[i+1] - pos[i] > MC_STORE_BATCH)? MC_STORE_BATCH : start[i+1] - pos[i];
+
+	    if (!init_request(mcon,srv,(noreply)? NULL :
+			(mcon->protocol == MC_PROTO_BINARY)?
+			parse_bin_store_reply : parse_store_reply,
+			keys,stored,keyidx + pos[i],m)){
+		pos[i] = start[i+1];
+		continue;
+	    }
+
+	    for (k = pos[i]; k < pos[i] + m; k++){
+		if (mcon->protocol == MC_PROTO_BINARY){
+		    hdrpos = append_bin_store_header(srv->obuf,opcode,
+			    CHAR(STRING_ELT(keys,keyidx[k])),
+			    INTEGER(exptime)[keyidx[k] % nexptime],k - pos[i]);
+		    queued = serialize_bin_store_buf(mcon,srv,hdrpos,
+			    VECTOR_ELT(values,keyidx[k]),&flags,&size);
+		} else {
+		    hdrpos = append_store_header(srv->obuf,CHAR(STRING_ELT(cmd,0)),
+			    CHAR(STRING_ELT(keys,keyidx[k])));
+		    queued = serialize_store_buf(mcon,srv,hdrpos,
+			    VECTOR_ELT(values,keyidx[k]),
+			    INTEGER(exptime)[keyidx[k] % nexptime],noreply,
+			    &flags,&size);
+		}
+		if (!queued){
+		    bigflags[i] = flags;
+		    bigsize[i] = size;
+		    break;
+		}
+	    }
+
+	    /* The batch ends before any value to be streamed */
+	    m = srv->req.n = k - pos[i];
+	    if (m == 0){
+		reset_request(srv);
+		continue;
+	    }
+	    if (mcon->protocol == MC_PROTO_BINARY){
+		hdrpos = srv->obuf->count;
+		append_bin_noop(srv->obuf,m);
+		queue_cmd(srv,hdrpos);
+	    }
+	    pos[i] += m;
+	}
+	if (began)
+	    metrics_phase(mcon,MC_PHASE_SERIALIZE,monotonic_time() - serialized);
+
+	if (quiet)
+	    quiet_requests(mcon);
+	else
+	    run_requests(mcon);
+
+	/* Give up on servers that failed, otherwise stream or chunk any
+	 * large value and go on to next batch
+	 */
+	for (i = 0; i < mcon->nservers; i++){
+	    srv = mcon->servers[i];
+	    if (srv->req.status == MC_FAILED)
+		pos[i] = start[i+1];
+	    else if (noreply && srv->req.status == MC_DONE)
+		for (k = first[i]; k < pos[i]; k++)
+		    LOGICAL(stored)[keyidx[k]] = TRUE;
+	}
+	for (i = 0; i < mcon->nservers; i++){
+	    srv = mcon->servers[i];
+	    if (bigsize[i] && pos[i] < start[i+1]){
+		if (quiet) flush_quiet(mcon,0); /* ahead of the value */
+		ok = ((mcon->chunksize > 0)? chunk_store : stream_store)(mcon,srv,
+			keys,VECTOR_ELT(values,keyidx[pos[i]]),
+			stored,keyidx + pos[i],CHAR(STRING_ELT(cmd,0)),opcode,
+			INTEGER(exptime)[keyidx[pos[i]] % nexptime],
+			bigflags[i],bigsize[i]);
+		pos[i] = (ok)? pos[i] + 1 : start[i+1];
+	    }
+	    bigsize[i] = 0;
+	    if (pos[i] < start[i+1]) more = TRUE;
+	}
+    } while (more);
+
+    release_iobufs(mcon);
+    stored = fold_replicas(stored,nkeys,nrep);
+    metrics_end(mcon,began,nkeys);
+    UNPROTECT(4);
+    return stored;
+}
+
+/* Returns a logical vector, TRUE for each key deleted, FALSE if not
+ * found, or NA on error. With noreply, TRUE once the command is sent,
+ * or added to the quiet batch in quiet mode. The binary protocol's
+ * quiet delete still replies to misses, so its replies are always read
+ * to keep the connection in step.
+ */
+static SEXP delete_values(mc_con *mcon, SEXP keys, int noreply){
+    int i, k, *keyidx, *start, quiet;
+    int nkeys = LENGTH(keys), nrep = replica_count(mcon);
+    double began = metrics_begin(mcon,MC_OP_DELETE);
+    mc_srv *srv;
+    SEXP deleted;
+
+    drop_near(mcon,keys);
+
+    /* Every copy goes, lest a get fall over to one left behind */
+    PROTECT(keys = replicate_vector(keys,nkeys,nrep));
+    PROTECT(deleted = allocVector(LGLSXP,LENGTH(keys)));
+    for (i = 0; i < LENGTH(keys); i++) LOGICAL(deleted)[i] = NA_LOGICAL;
+
+    group_replicas(mcon,keys,nkeys,0,&keyidx,&start);
+
+    quiet = (noreply && mcon->protocol == MC_PROTO_ASCII && mcon->quiet_batch > 0);
+    if (quiet)
+	begin_requests(mcon);
+    else
+	reset_requests(mcon);
+    for (i = 0; i < mcon->nservers; i++){
+	if (start[i] == start[i+1]) continue;
+	srv = mcon->servers[i];
+
+	if (mcon->protocol == MC_PROTO_BINARY){
+	    if (!init_request(mcon,srv,parse_bin_delete_reply,keys,deleted,
+			keyidx + start[i],start[i+1] - start[i]))
+		continue;
+
+	    for (k = start[i]; k < start[i+1]; k++)
+		append_bin_delete_cmd(srv->obuf,CHAR(STRING_ELT(keys,keyidx[k])),
+			k - start[i]);
+	    append_bin_noop(srv->obuf,start[i+1] - start[i]);
+	    queue_cmd(srv,0);
+	    continue;
+	}
+
+	if (!init_request(mcon,srv,(noreply)? NULL : parse_delete_reply,keys,deleted,
+		    keyidx + start[i],start[i+1] - start[i]))
+	    continue;
+
+	for (k = start[i]; k < start[i+1]; k++)
+	    append_delete_cmd(srv->obuf,CHAR(STRING_ELT(keys,keyidx[k])),noreply);
+	queue_cmd(srv,0);
+    }
+    if (quiet)
+	quiet_requests(mcon);
+    else
+	run_requests(mcon);
+
+    if (noreply && mcon->protocol == MC_PROTO_ASCII){
+	for (i = 0; i < mcon->nservers; i++){
+	    if (mcon->servers[i]->req.status != MC_DONE) continue;
+	    for (k = start[i]; k < start[i+1]; k++)
+		LOGICAL(deleted)[keyidx[k]] = TRUE;
+	}
+    }
+
+    release_iobufs(mcon);
+    deleted = fold_replicas(deleted,nkeys,nrep);
+    metrics_end(mcon,began,nkeys);
+    UNPROTECT(2);
+    return deleted;
+}
+
+/* Returns the new values of the counters keys after adding or, with
+ * decr, subtracting deltas, recycled over keys. Keys not found, holding
+ * a value that isn't a number or on a server that couldn't be reached
+ * are NA. The commands for a server all go out in one write. The result
+ * is an integer vector unless some value is too large for one, in which
+ * case it's a double vector.
+ *
+ * With noreply, which the binary protocol ignores, the result is instead
+ * a logical vector, TRUE for each key once its command is written or
+ * added to the quiet batch.
+ */
+static SEXP counter_values(mc_con *mcon, SEXP keys, SEXP deltas, int decr,
+	int noreply){
+    int i, k, *keyidx, *start, fits = TRUE, quiet;
+    int nkeys = LENGTH(keys), nrep = replica_count(mcon);
+    double began = metrics_begin(mcon,MC_OP_COUNTER);
+    mc_srv *srv;
+    SEXP values;
+    double d;
+    unsigned long long delta;
+
+    drop_near(mcon,keys);
+
+    /* Each copy is updated; the first that answers gives the value */
+    PROTECT(keys = replicate_vector(keys,nkeys,nrep));
+    PROTECT(values = allocVector(REALSXP,LENGTH(keys)));
+    for (i = 0; i < LENGTH(keys); i++) REAL(values)[i] = NA_REAL;
+
+    group_replicas(mcon,keys,nkeys,0,&keyidx,&start);
+
+    if (mcon->protocol == MC_PROTO_BINARY) noreply = FALSE;
+    quiet = (noreply && mcon->quiet_batch > 0);
+    if (quiet)
+	begin_requests(mcon);
+    else
+	reset_requests(mcon);
+    for (i = 0; i < mcon->nservers; i++){
+	if (start[i] == start[i+1]) continue;
+	srv = mcon->servers[i];
+
+	if (!init_request(mcon,srv,(noreply)? NULL :
+		    (mcon->protocol == MC_PROTO_BINARY)?
+		    parse_bin_counter_reply : parse_counter_reply,keys,values,
+		    keyidx + start[i],start[i+1] - start[i]))
+	    continue;
+
+	for (k = start[i]; k < start[i+1]; k++){
+	    delta = (unsigned long long)REAL(deltas)[keyidx[k] % LENGTH(deltas)];
+	    if (mcon->protocol == MC_PROTO_BINARY)
+		append_bin_counter_cmd(srv->obuf,(decr)? MC_BIN_DECREMENT :
+			MC_BIN_INCREMENT,CHAR(STRING_ELT(keys,keyidx[k])),delta,
+			k - start[i]);
+	    else
+		append_counter_cmd(srv->obuf,(decr)? "decr" : "incr",
+			CHAR(STRING_ELT(keys,keyidx[k])),delta,noreply);
+	}
+	if (mcon->protocol == MC_PROTO_BINARY)
+	    append_bin_noop(srv->obuf,start[i+1] - start[i]);
+	queue_cmd(srv,0);
+    }
+    if (quiet)
+	quiet_requests(mcon);
+    else
+	run_requests(mcon);
+
+    release_iobufs(mcon);
+
+    if (noreply){
+	PROTECT(values = allocVector(LGLSXP,LENGTH(keys)));
+	for (i = 0; i < LENGTH(keys); i++) LOGICAL(values)[i] = NA_LOGICAL;
+	for (i = 0; i < mcon->nservers; i++){
+	    if (mcon->servers[i]->req.status != MC_DONE) continue;
+	    for (k = start[i]; k < start[i+1]; k++)
+		LOGICAL(values)[keyidx[k]] = TRUE;
+	}
+	values = fold_replicas(values,nkeys,nrep);
+	metrics_end(mcon,began,nkeys);
+	UNPROTECT(3);
+	return values;
+    }
+
+    PROTECT(values = fold_replicas(values,nkeys,nrep));
+    for (i = 0; i < nkeys; i++){
+	d = REAL(values)[i];
+	if (!ISNAN(d) && d > INT_MAX) fits = FALSE;
+    }
+    if (fits) values = coerceVector(values,INTSXP);
+
+    metrics_end(mcon,began,nkeys);
+    UNPROTECT(3);
+    return values;
+}
+
+/* Checks that deltas are whole numbers from 0 to 2^64-1, recyclable
+ * over n keys.
+ */
+static int check_deltas(SEXP deltas, int n){
+    int i;
+    double d;
+
+    if (!isReal(deltas) || LENGTH(deltas) == 0 || n % LENGTH(deltas) != 0){
+	warning("rmemcache: deltas must be a numeric vector recycling over the keys!");
+	return FALSE;
+    }
+    for (i = 0; i < LENGTH(deltas); i++){
+	d = REAL(deltas)[i];
+	if (ISNAN(d) || d < 0 || d >= 18446744073709551616.0 ||
+		d != (double)(unsigned long long)d){
+	    warning("rmemcache: deltas must be whole numbers from 0 to 2^64-1!");
+	    return FALSE;
+	}
+    }
+    return TRUE;
+}
+
+/* The single key calls use only the first element of key */
+static SEXP scalar_key(SEXP key){
+    if (!isString(key) || LENGTH(key) < 1)
+	error("rmemcache: key must be a character vector!");
+    return (LENGTH(key) == 1)? key : ScalarString(STRING_ELT(key,0));
+}
+
+/* 
+ * Storage commands: add, set, replace
+ *
+ * client sends:
+ *     <cmd> <key> <flags> <exptime> <bytes> [noreply]\r\n
+ *     <data>\r\n
+ * server sends:
+ *     STORED\r\n
+ *     NOT_STORED\r\n
+ */
+SEXP mc_store(SEXP mcon_s, SEXP key, SEXP value, SEXP exptime, SEXP cmd,
+	SEXP noReply){
+    SEXP values, stored;
+    mc_con *mcon = unmarshall_con(mcon_s);
+
+    if (!mcon) return ScalarLogical(FALSE);
+
+    PROTECT(key = scalar_key(key));
+    PROTECT(values = allocVector(VECSXP,1));
+    SET_VECTOR_ELT(values,0,value);
+
+    stored = store_values(mcon,key,values,exptime,cmd,asLogical(noReply) == TRUE);
+
+    UNPROTECT(2);
+    return ScalarLogical(LOGICAL(stored)[0]);
+}
+
+/*
+ * Storage commands for many keys: add, set, replace
+ *
+ * Returns a logical vector, TRUE for each key stored, or with noReply
+ * sent.
+ */
+SEXP mc_store_multi(SEXP mcon_s, SEXP keys, SEXP values, SEXP exptime, SEXP cmd,
+	SEXP noReply){
+    mc_con *mcon = unmarshall_con(mcon_s);
+
+    if (!mcon) return R_NilValue;
+
+    if (!isString(keys) || !isNewList(values) || LENGTH(keys) != LENGTH(values)){
+	warning("rmemcache: keys and values must be a character vector and list of the same length!");
+	return R_NilValue;
+    }
+    if (LENGTH(exptime) == 0){
+	warning("rmemcache: exptime must not be empty!");
+	return R_NilValue;
+    }
+
+    return store_values(mcon,keys,values,exptime,cmd,asLogical(noReply) == TRUE);
+}
+
+SEXP mc_get(SEXP mcon_s, SEXP key_s){
+    SEXP value;
+    mc_con *mcon = unmarshall_con(mcon_s);
+
+    if (!mcon) return R_NilValue;
+
+    PROTECT(key_s = scalar_key(key_s));
+    value = get_values(mcon,key_s);
+    UNPROTECT(1);
+
+    return VECTOR_ELT(value,0);
+}
+
+/*
+ * Get many values, sending one "get <key>*" command to each server.
+ *
+ * Returns a list named by keys. Keys not found, or on a server that
+ * couldn't be reached, are NULL.
+ */
+SEXP mc_get_multi(SEXP mcon_s, SEXP keys){
+    mc_con *mcon = unmarshall_con(mcon_s);
+
+    if (!mcon) return R_NilValue;
+
+    if (!isString(keys)){
+	warning("rmemcache: keys must be a character vector!");
+	return R_NilValue;
+    }
+
+    return get_values(mcon,keys);
+}
+
+SEXP mc_delete(SEXP mcon_s, SEXP key_s, SEXP noReply){
+    int deleted;
+    mc_con *mcon = unmarshall_con(mcon_s);
+
+    if (!mcon) return R_NilValue;
+
+    PROTECT(key_s = scalar_key(key_s));
+    deleted = LOGICAL(delete_values(mcon,key_s,asInteger(noReply) == TRUE))[0];
+    UNPROTECT(1);
 
     /* Network error or server sent an error message */
-    if (response == NULL || error_occured(response)){
-	destroy_iobufs(mcon);
+    if (deleted == NA_LOGICAL) return R_NilValue;
+
+    return ScalarLogical(deleted);
+}
+
+/*
+ * Compress values whose serialized size is larger than threshold bytes
+ * with algo, "lz4" or "zstd". A threshold of 0 turns compression off.
+ */
+SEXP mc_compress(SEXP mcon_s, SEXP threshold, SEXP algo){
+    int compress;
+    const char *name;
+    mc_con *mcon = unmarshall_con(mcon_s);
+    if (!mcon) return ScalarLogical(FALSE);
+
+    if (!isString(algo) || LENGTH(algo) != 1){
+	warning("rmemcache: algo must be \"lz4\" or \"zstd\"");
+	return ScalarLogical(FALSE);
+    }
+    name = CHAR(STRING_ELT(algo,0));
+    if (strcmp(name,"lz4") == 0)
+	compress = MC_COMPRESS_LZ4;
+    else if (strcmp(name,"zstd") == 0)
+	compress = MC_COMPRESS_ZSTD;
+    else {
+	warning("rmemcache: algo must be \"lz4\" or \"zstd\"");
+	return ScalarLogical(FALSE);
+    }
+    if (!compress_available(compress)){
+	warning("rmemcache: rmemcache was built without %s",name);
+	return ScalarLogical(FALSE);
+    }
+    if (asInteger(threshold) == NA_INTEGER || asInteger(threshold) < 0){
+	warning("rmemcache: threshold must be a non-negative integer");
+	return ScalarLogical(FALSE);
+    }
+
+    mcon->threshold = asInteger(threshold);
+    mcon->compress = (mcon->threshold > 0)? compress : MC_COMPRESS_NONE;
+
+    return ScalarLogical(TRUE);
+}
+
+/*
+ * Store values whose serialized (and compressed) size is larger than
+ * size bytes in chunks of that size, spread across the servers. A size
+ * of 0 turns chunking off. Chunked values are read back whatever the
+ * setting.
+ */
+SEXP mc_chunk(SEXP mcon_s, SEXP size){
+    mc_con *mcon = unmarshall_con(mcon_s);
+    if (!mcon) return ScalarLogical(FALSE);
+
+    if (asInteger(size) == NA_INTEGER || asInteger(size) < 0){
+	warning("rmemcache: size must be a non-negative integer");
+	return ScalarLogical(FALSE);
+    }
+
+    mcon->chunksize = asInteger(size);
+
+    return ScalarLogical(TRUE);
+}
+
+/*
+ * Store raw vectors, scalar strings and double and integer vectors
+ * without attributes as typed payloads if typed, and serialize other
+ * values in native rather than XDR format if native. Values are read
+ * back whatever the settings.
+ */
+SEXP mc_format(SEXP mcon_s, SEXP typed, SEXP native){
+    mc_con *mcon = unmarshall_con(mcon_s);
+    if (!mcon) return ScalarLogical(FALSE);
+
+    if (asLogical(typed) == NA_LOGICAL || asLogical(native) == NA_LOGICAL){
+	warning("rmemcache: typed and native must be TRUE or FALSE");
+	return ScalarLogical(FALSE);
+    }
+
+    mcon->typed = asLogical(typed);
+    mcon->native = asLogical(native);
+
+    return ScalarLogical(TRUE);
+}
+
+/*
+ * Increment or decrement the counter key by byval, returning its new
+ * value or NULL if key wasn't found or the command failed. With noReply,
+ * TRUE once the command is sent, or NULL.
+ */
+static SEXP counter_value(SEXP mcon_s, SEXP key_s, SEXP byval, int decr,
+	SEXP noReply){
+    SEXP value;
+    mc_con *mcon = unmarshall_con(mcon_s);
+
+    if (!mcon) return R_NilValue;
+
+    PROTECT(key_s = scalar_key(key_s));
+    if (!check_deltas(byval,1)){
+	UNPROTECT(1);
+	return R_NilValue;
+    }
+    PROTECT(value = counter_values(mcon,key_s,byval,decr,
+		asLogical(noReply) == TRUE));
+    UNPROTECT(2);
+
+    if ((isLogical(value) && LOGICAL(value)[0] == NA_LOGICAL) ||
+	    (isInteger(value) && INTEGER(value)[0] == NA_INTEGER) ||
+	    (isReal(value) && ISNAN(REAL(value)[0])))
+	return R_NilValue;
+    return value;
+}
+
+/*
+ * Keep up to size bytes of values got through the connection in process,
+ * each for at most ttl seconds, or for as long as it's not evicted if
+ * ttl is 0. A size of 0 turns the near cache off and empties it.
+ */
+SEXP mc_nearcache(SEXP mcon_s, SEXP size, SEXP ttl){
+    mc_con *mcon = unmarshall_con(mcon_s);
+    if (!mcon) return ScalarLogical(FALSE);
+
+    if (!isReal(size) || LENGTH(size) != 1 || ISNAN(REAL(size)[0]) ||
+	    REAL(size)[0] < 0){
+	warning("rmemcache: size must be a non-negative number");
+	return ScalarLogical(FALSE);
+    }
+    if (!isReal(ttl) || LENGTH(ttl) != 1 || ISNAN(REAL(ttl)[0]) ||
+	    REAL(ttl)[0] < 0){
+	warning("rmemcache: ttl must be a non-negative number");
 	return ScalarLogical(FALSE);
     }
 
-    /* Conditions for add or replace weren't met or
-     * key is in a delete queue
-     */
-    if (strcmp("NOT_STORED\r",response) == 0){
-	destroy_iobufs(mcon);
+    mcon->near.budget = (size_t)REAL(size)[0];
+    mcon->near.ttl = REAL(ttl)[0];
+    if (mcon->near.budget == 0)
+	clear_near(mcon);
+    else
+	evict_near(&mcon->near);
+
+    return ScalarLogical(TRUE);
+}
+
+/*
+ * Set the connection options named in the list options, see
+ * mc_options_tab. Every option is checked before any is set, so that a
+ * bad one leaves the connection as it was.
+ */
+SEXP mc_options(SEXP mcon_s, SEXP options){
+    int i, j, set;
+    const char *name;
+    double d;
+    SEXP names, value;
+    char *field;
+    mc_con *mcon = unmarshall_con(mcon_s);
+    if (!mcon) return ScalarLogical(FALSE);
+
+    names = getAttrib(options,R_NamesSymbol);
+    if (!isNewList(options) || (LENGTH(options) > 0 && isNull(names))){
+	warning("rmemcache: options must be a named list");
 	return ScalarLogical(FALSE);
     }
 
-    /* Success! */
-    if (strcmp("STORED\r",response) == 0){
-	destroy_iobufs(mcon);
-	return ScalarLogical(TRUE);
+    for (set = 0; set < 2; set++) for (i = 0; i < LENGTH(options); i++){
+	name = CHAR(STRING_ELT(names,i));
+	value = VECTOR_ELT(options,i);
+	for (j = 0; j < MC_NOPTIONS; j++)
+	    if (strcmp(name,mc_options_tab[j].name) == 0) break;
+	if (j == MC_NOPTIONS){
+	    warning("rmemcache: unknown option %s",name);
+	    return ScalarLogical(FALSE);
+	}
+
+	field = (char *)mcon + mc_options_tab[j].offset;
+	switch (mc_options_tab[j].type){
+	    case MC_OPT_COUNT:
+		if (asInteger(value) == NA_INTEGER || asInteger(value) < 0){
+		    warning("rmemcache: %s must be a non-negative integer",name);
+		    return ScalarLogical(FALSE);
+		}
+		if (set) *(int *)field = asInteger(value);
+		break;
+	    case MC_OPT_SECONDS:
+		d = asReal(value);
+		if (ISNAN(d) || d < 0){
+		    warning("rmemcache: %s must be a non-negative number of seconds",name);
+		    return ScalarLogical(FALSE);
+		}
+		if (set) *(double *)field = d;
+		break;
+	    case MC_OPT_TIMEOUT:
+		d = asReal(value);
+		if (ISNAN(d) || d < 0.001 || d > INT_MAX / 1000){
+		    warning("rmemcache: %s must be a number of seconds, at least 0.001",name);
+		    return ScalarLogical(FALSE);
+		}
+		if (set) *(double *)field = d;
+		break;
+	    case MC_OPT_BOOL:
+		if (asLogical(value) == NA_LOGICAL){
+		    warning("rmemcache: %s must be TRUE or FALSE",name);
+		    return ScalarLogical(FALSE);
+		}
+		if (set) *(int *)field = asLogical(value);
+		break;
+	}
     }
+    sync_metrics(mcon);
+    sync_io(mcon);
 
-    /* shouldn't ever get here */
-    destroy_iobufs(mcon);
-    return ScalarLogical(FALSE);
+    return ScalarLogical(TRUE);
 }
 
-static int inchar(R_inpstream_t stream){
-    mc_buf *buf = stream->data;
-    int c;
-    if (buf->curpos >= buf->count)
-	error("rmemcache: read error in inchar()");
-    return buf->buf[buf->curpos++];
+SEXP mc_incr(SEXP mcon_s, SEXP key_s, SEXP byval, SEXP noReply){
+    return counter_value(mcon_s,key_s,byval,FALSE,noReply);
 }
 
-static void inbytes(R_inpstream_t stream, void *bytes, int length){
-    mc_buf *buf = stream->data;
-    if (buf->curpos + length >= buf->count)
-	error("rmemcache: read error in inbytes()");
-
-    memcpy(bytes,buf->buf + buf->curpos, length);
-    buf->curpos += length;
+SEXP mc_decr(SEXP mcon_s, SEXP key_s, SEXP byval, SEXP noReply){
+    return counter_value(mcon_s,key_s,byval,TRUE,noReply);
 }
 
-SEXP mc_get(SEXP mcon_s, SEXP key_s){
-    int i, keylen, flags;
-    const char *key;
-    char *response, *rptr;
-    size_t bytes, startpos;
-    mc_srv *srv;
-    struct R_inpstream_st in;
-    SEXP value;
+/*
+ * Counter commands for many keys: incr, decr
+ *
+ * Returns the new values named by keys, NA for each key not found or
+ * that failed, or with noReply TRUE for each key sent.
+ */
+SEXP mc_counter_multi(SEXP mcon_s, SEXP keys, SEXP deltas, SEXP cmd, SEXP noReply){
+    SEXP values;
     mc_con *mcon = unmarshall_con(mcon_s);
 
     if (!mcon) return R_NilValue;
 
-    /* Determine which server we'll be working with */
-    i = hash_servers(mcon,key_s);
-    if (i == -1) return R_NilValue;
-    srv = mcon->servers[i];
-
-    /* Connect to it */
-    if (srv->scon == -1 && (srv->scon = mc_SockConnect(srv->port,srv->host)) == -1)
+    if (!isString(keys)){
+	warning("rmemcache: keys must be a character vector!");
 	return R_NilValue;
+    }
+    if (!check_deltas(deltas,LENGTH(keys))) return R_NilValue;
 
-    /* Send get command */
-    key = CHAR(STRING_ELT(key_s,0));
-    if ((mcon->obuf = init_get_buf(key)) == NULL)
-	return R_NilValue;
-    if (writeline_buf(srv,mcon->obuf) <= 0)
-	return R_NilValue;
+    PROTECT(values = counter_values(mcon,keys,deltas,
+		strcmp(CHAR(STRING_ELT(cmd,0)),"decr") == 0,asLogical(noReply) == TRUE));
+    setAttrib(values,R_NamesSymbol,keys);
+    UNPROTECT(1);
 
-    /* Read result from server, should only be 1 line */
-    if ((mcon->ibuf = init_buf(1)) == NULL) 
-	return R_NilValue;
+    return values;
+}
+
+/*
+ * Statistics: stats [<group>]
+ *
+ * client sends:
+ *     stats [<group>]\r\n
+ * server sends:
+ *     STAT <name> <value>\r\n
+ *     ...
+ *     END\r\n
+ *
+ * The binary protocol's STAT takes the group as its key and replies
+ * with a response per statistic, name as key and value as value, ended
+ * by one with neither.
+ *
+ * The parsers leave the reply in ibuf, to be read by stats_frame() once
+ * every server has answered.
+ */
+typedef struct {
+    const char *name, *value;
+    size_t namelen, valuelen;
+    int srv;
+} mc_stat;
+
+static int parse_stats_reply(mc_srv *srv){
+    mc_buf *buf = srv->ibuf;
+    unsigned char *line, *nl;
+    size_t pos = buf->curpos;
+
+    while ((nl = memchr(buf->buf + pos,'\n',buf->count - pos)) != NULL){
+	line = buf->buf + pos;
+	if (nl - line < 5 || strncmp((char *)line,"STAT ",5) != 0){
+	    /* END, or an error for a group the server doesn't know */
+	    error_occured((char *)line,nl - line + 1);
+	    return MC_DONE;
+	}
+	pos = nl - buf->buf + 1;
+    }
 
-    response = readline_buf(srv,mcon->ibuf); 
+    return MC_PENDING;
+}
 
-    /* Network error or server sent an error message */
-    if (response == NULL || error_occured(response))
-	return R_NilValue;
+static int parse_bin_stats_reply(mc_srv *srv){
+    mc_buf *buf = srv->ibuf;
+    unsigned char *hdr;
+    size_t pos = buf->curpos, bodylen;
+
+    while (buf->count - pos >= MC_BIN_HDR_LEN){
+	hdr = buf->buf + pos;
+	if (hdr[0] != MC_BIN_RES_MAGIC || hdr[1] != MC_BIN_STAT) return MC_FAILED;
+	bodylen = get32(hdr + 8);
+	if (buf->count - pos < MC_BIN_HDR_LEN + bodylen) break;
+	if (get16(hdr + 6) != 0){
+	    bin_error(hdr,bodylen);
+	    return MC_DONE;
+	}
+	if (get16(hdr + 2) == 0) return MC_DONE;
+	pos += MC_BIN_HDR_LEN + bodylen;
+    }
 
-    /* END reached ? */
-    if (strncmp("END\r",response,4) == 0) /* Key not found. */
-	return R_NilValue;
+    return MC_PENDING;
+}
 
-    /* VALUE */
-    if (strncmp("VALUE",response,5) != 0) return R_NilValue;
-    response += 6; /* move past "VALUE " */
+/* Collects the statistics in the reply left in srv's ibuf to stats,
+ * returning how many there were. stats may be NULL to only count them.
+ */
+static int collect_stats(mc_con *mcon, int i, mc_stat *stats){
+    mc_srv *srv = mcon->servers[i];
+    mc_buf *buf = srv->ibuf;
+    unsigned char *p, *end, *nl, *sp;
+    int n = 0;
+
+    if (srv->req.status != MC_DONE) return 0;
+
+    p = buf->buf + buf->curpos;
+    end = buf->buf + buf->count;
+    while (p < end){
+	if (mcon->protocol == MC_PROTO_BINARY){
+	    size_t keylen = get16(p + 2), bodylen = get32(p + 8);
+	    if (get16(p + 6) != 0 || keylen == 0) break;
+	    if (stats){
+		stats[n].name = (char *)p + MC_BIN_HDR_LEN + p[4];
+		stats[n].namelen = keylen;
+		stats[n].value = stats[n].name + keylen;
+		stats[n].valuelen = bodylen - p[4] - keylen;
+	    }
+	    p += MC_BIN_HDR_LEN + bodylen;
+	} else {
+	    if ((nl = memchr(p,'\n',end - p)) == NULL ||
+		    strncmp((char *)p,"STAT ",5) != 0)
+		break;
+	    if (stats){
+		stats[n].name = (char *)p + 5;
+		sp = memchr(p + 5,' ',nl - p - 5);
+		if (sp == NULL) sp = nl;
+		stats[n].namelen = sp - p - 5;
+		stats[n].value = (char *)sp + (sp < nl);
+		stats[n].valuelen = nl - (unsigned char *)stats[n].value;
+		if (stats[n].valuelen > 0 && stats[n].value[stats[n].valuelen - 1] == '\r')
+		    stats[n].valuelen--;
+	    }
+	    p = nl + 1;
+	}
+	if (stats) stats[n].srv = i;
+	n++;
+    }
 
-    /* Save start position of unserialized variable */
-    startpos = mcon->ibuf->curpos;
+    return n;
+}
 
-    /* Key */
-    keylen = strlen(key);
-    if (strncmp(response,key,keylen) != 0) return R_NilValue;
-    response += keylen;
+/* Parses a statistic into d, returning FALSE if it isn't a number */
+static int stat_number(const char *value, size_t len, double *d){
+    char num[64], *end;
 
-    /* Flags */
-    rptr = NULL;
-    flags = (int)strtol(response,&rptr,10);
-    if (flags == 0 && response == rptr) /* error occured */
-	return R_NilValue;
+    if (len == 0 || len >= sizeof(num)) return FALSE;
+    memcpy(num,value,len);
+    num[len] = '\0';
+    *d = strtod(num,&end);
+    return (*end == '\0');
+}
 
-    if (rptr == NULL) return R_NilValue;
+/* Builds a data frame with a row per server and a column per statistic,
+ * in the order first seen. Columns whose values are all numbers are
+ * numeric. Statistics a server didn't report, or servers that couldn't
+ * be reached, are NA.
+ */
+static SEXP stats_frame(mc_con *mcon){
+    int i, j, k, n = 0, ncols = 0, numeric, *col;
+    double d;
+    mc_stat *stats, **first;
+    SEXP frame, names, rownames, column;
+    char *rowname;
+
+    for (i = 0; i < mcon->nservers; i++) n += collect_stats(mcon,i,NULL);
+    stats = (mc_stat *)R_alloc(n + 1,sizeof(mc_stat));
+    col = (int *)R_alloc(n + 1,sizeof(int));
+    first = (mc_stat **)R_alloc(n + 1,sizeof(mc_stat *));
+    for (i = 0, k = 0; i < mcon->nservers; i++) k += collect_stats(mcon,i,stats + k);
+
+    /* Servers mostly report the same statistics in the same order, so
+     * the column after the previous one is tried first.
+     */
+    for (k = 0, j = -1; k < n; k++){
+	if (j + 1 < ncols && first[j + 1]->namelen == stats[k].namelen &&
+		memcmp(first[j + 1]->name,stats[k].name,stats[k].namelen) == 0){
+	    col[k] = ++j;
+	    continue;
+	}
+	for (j = 0; j < ncols; j++)
+	    if (first[j]->namelen == stats[k].namelen &&
+		    memcmp(first[j]->name,stats[k].name,stats[k].namelen) == 0)
+		break;
+	if (j == ncols) first[ncols++] = &stats[k];
+	col[k] = j;
+    }
 
-    response = rptr; 
+    PROTECT(frame = allocVector(VECSXP,ncols));
+    PROTECT(names = allocVector(STRSXP,ncols));
+    for (j = 0; j < ncols; j++){
+	SET_STRING_ELT(names,j,mkCharLen(first[j]->name,first[j]->namelen));
 
+	numeric = TRUE;
+	for (k = 0; k < n && numeric; k++)
+	    if (col[k] == j && !stat_number(stats[k].value,stats[k].valuelen,&d))
+		numeric = FALSE;
 
-    /* bytes */
-    rptr = NULL;
-    bytes = (size_t)strtol(response,&rptr,10);
-    if (flags == 0 && response == rptr) /* error occured */
-	return R_NilValue;
+	column = allocVector((numeric)? REALSXP : STRSXP,mcon->nservers);
+	SET_VECTOR_ELT(frame,j,column);
+	for (i = 0; i < mcon->nservers; i++){
+	    if (numeric) REAL(column)[i] = NA_REAL;
+	    else SET_STRING_ELT(column,i,NA_STRING);
+	}
+	for (k = 0; k < n; k++){
+	    if (col[k] != j) continue;
+	    if (numeric)
+		stat_number(stats[k].value,stats[k].valuelen,&REAL(column)[stats[k].srv]);
+	    else
+		SET_STRING_ELT(column,stats[k].srv,
+			mkCharLen(stats[k].value,stats[k].valuelen));
+	}
+    }
+    setAttrib(frame,R_NamesSymbol,names);
 
-    if (rptr == NULL) return R_NilValue;
+    PROTECT(rownames = allocVector(STRSXP,mcon->nservers));
+    for (i = 0; i < mcon->nservers; i++){
+	rowname = R_alloc(strlen(mcon->servers[i]->host) + 16,1);
+	server_name(mcon->servers[i],rowname);
+	SET_STRING_ELT(rownames,i,mkChar(rowname));
+    }
+    setAttrib(frame,R_RowNamesSymbol,rownames);
+    setAttrib(frame,R_ClassSymbol,mkString("data.frame"));
 
-    response = rptr;
+    UNPROTECT(3);
+    return frame;
+}
+
+/*
+ * Get the statistics of every server, or those of the group args, such
+ * as "slabs", "items" or "settings". The servers are queried at once.
+ *
+ * Returns a data frame with a row per server.
+ */
+SEXP mc_stats(SEXP mcon_s, SEXP args){
+    int i;
+    size_t len;
+    const char *group = "";
+    mc_srv *srv;
+    SEXP frame;
+    mc_con *mcon = unmarshall_con(mcon_s);
 
-    /* End of Line */
-    if (strncmp("\r",response,1) != 0) return R_NilValue;
+    if (!mcon) return R_NilValue;
 
-    /* Success! let's read result. */
-    resize_buf(mcon->ibuf,bytes);
-    if (!readbytes_buf(srv,mcon->ibuf,bytes))
-	return ScalarLogical(FALSE);
-    seek_buf(mcon->ibuf,startpos);
+    if (!isNull(args)){
+	if (!isString(args) || LENGTH(args) != 1 ||
+		strpbrk(CHAR(STRING_ELT(args,0))," \r\n") != NULL){
+	    warning("rmemcache: args must be a single statistics group!");
+	    return R_NilValue;
+	}
+	group = CHAR(STRING_ELT(args,0));
+    }
+    len = strlen(group);
+
+    reset_requests(mcon);
+    for (i = 0; i < mcon->nservers; i++){
+	srv = mcon->servers[i];
+	if (!init_request(mcon,srv,(mcon->protocol == MC_PROTO_BINARY)?
+		    parse_bin_stats_reply : parse_stats_reply,R_NilValue,
+		    R_NilValue,NULL,0))
+	    continue;
+
+	if (mcon->protocol == MC_PROTO_BINARY){
+	    append_bin_header(srv->obuf,MC_BIN_STAT,len,0,len,0);
+	    memcpy(srv->obuf->buf + srv->obuf->count,group,len);
+	    srv->obuf->count += len;
+	} else {
+	    resize_buf(srv->obuf,len + 9);
+	    sprintf((char *)srv->obuf->buf,(len)? "stats %s\r\n" : "stats\r\n",group);
+	    srv->obuf->count = strlen((char *)srv->obuf->buf);
+	}
+	queue_cmd(srv,0);
+    }
+    run_requests(mcon);
 
-    /* Serialize to buf. may have to use setjmp/longjmp if buf error occurs*/
-    R_InitInPStream(&in,mcon->ibuf,R_pstream_xdr_format,
-	    inchar, inbytes, NULL, R_NilValue);
+    frame = stats_frame(mcon);
 
+    release_iobufs(mcon);
+    return frame;
+}
 
-    value =  R_Unserialize(&in);
-    destroy_iobufs(mcon);
-    return value;
+/*
+ * Asynchronous gets and stores
+ *
+ * mc_get_async() and mc_store_async() queue their commands the way
+ * get_values() and store_values() do and write them, but return a
+ * handle without waiting for the replies. Each server keeps the
+ * requests written to it in srv->pending, and read_pending() parses
+ * their replies in that order when a handle is waited on or collected,
+ * or before any other operation on the connection. Replies that arrive
+ * while later requests are being written are read into srv->ibuf, so a
+ * server is never left blocked on a full socket.
+ */
+
+static mc_async *unmarshall_async(SEXP handle){
+    mc_async *async;
+
+    if (TYPEOF(handle) != EXTPTRSXP ||
+	    R_ExternalPtrTag(handle) != MCASYNC_type_tag ||
+	    (async = R_ExternalPtrAddr(handle)) == NULL)
+	error("rmemcache: SEXP not an async handle");
+    return async;
 }
 
-SEXP mc_delete(SEXP mcon_s, SEXP key_s, SEXP noReply){
-    int i, keylen, flags;
-    const char *key;
-    char *response, *rptr;
-    size_t bytes, startpos;
+static void mc_finalize_async(SEXP handle){
+    mc_async *async = R_ExternalPtrAddr(handle);
+
+    if (async == NULL) return;
+    R_ClearExternalPtr(handle);
+    if (async->npending > 0)
+	async->orphaned = TRUE;
+    else
+	free(async);
+}
+
+/* Returns a handle on a new async for keys on the connection mcon_s,
+ * setting *async.
+ */
+static SEXP new_async(SEXP mcon_s, SEXP keys, int get, mc_async **async){
+    SEXP data, handle;
+
+    PROTECT(data = allocVector(VECSXP,MC_ASYNC_SLOTS));
+    SET_VECTOR_ELT(data,MC_ASYNC_CON,mcon_s);
+    SET_VECTOR_ELT(data,MC_ASYNC_KEYS,keys);
+    if ((*async = calloc(1,sizeof(mc_async))) == NULL)
+	error("rmemcache: cannot allocate an async handle");
+    (*async)->get = get;
+    (*async)->nkeys = LENGTH(keys);
+    (*async)->nrep = 1;
+    (*async)->data = data;
+    PROTECT(handle = R_MakeExternalPtr(*async,MCASYNC_type_tag,data));
+    R_RegisterCFinalizerEx(handle,mc_finalize_async,TRUE);
+    UNPROTECT(2);
+    return handle;
+}
+
+/* Readies the servers for the requests of a new async, first reading
+ * back every reply if a server has too many outstanding.
+ */
+static void begin_async(mc_con *mcon){
+    int i;
+
+    io_reap(mcon,MC_IO_RING); /* take back whatever the I/O thread is done with */
+
+    /* A request left pending by an error gets its socket closed below,
+     * which the I/O thread mustn't be writing to
+     */
+    for (i = 0; i < mcon->nservers; i++)
+	if (mcon->servers[i]->req.status == MC_PENDING &&
+		mcon->servers[i]->nwriting > 0){
+	    io_reap(mcon,0);
+	    break;
+	}
+    flush_quiet(mcon,0);
+    for (i = 0; i < mcon->nservers; i++)
+	if (mcon->servers[i]->npending >= MC_ASYNC_DEPTH){
+	    read_pending(mcon,NULL);
+	    break;
+	}
+    for (i = 0; i < mcon->nservers; i++)
+	reset_request(mcon->servers[i]);
+}
+
+/* Writes the requests queued for async, set up without a parser, or
+ * hands them to the I/O thread, and queues them in srv->pending to have
+ * their replies read with parse. The keys of a server that failed are
+ * left unanswered.
+ */
+static void write_async(mc_con *mcon, mc_async *async, int (*parse)(mc_srv *)){
+    int i;
     mc_srv *srv;
-    struct R_inpstream_st in;
-    SEXP value;
+    mc_pending *p, **last;
 
+    if (mcon->io == NULL) run_requests(mcon);
+
+    for (i = 0; i < mcon->nservers; i++){
+	srv = mcon->servers[i];
+	if (srv->req.keyidx == NULL) continue;
+	if (mcon->io == NULL && srv->req.status != MC_DONE){
+	    async->failed++;
+	    continue;
+	}
+	if ((p = malloc(sizeof(mc_pending))) == NULL ||
+		(p->req.keyidx = malloc(srv->req.n * sizeof(int))) == NULL){
+	    free(p);
+	    io_reap(mcon,0);
+	    close_srv(srv); /* its replies would be read by nobody */
+	    async->failed++;
+	    continue;
+	}
+	memcpy(p->req.keyidx,srv->req.keyidx,srv->req.n * sizeof(int));
+	p->req.status = MC_PENDING;
+	p->req.parse = parse;
+	p->req.keys = srv->req.keys;
+	p->req.result = srv->req.result;
+	p->req.n = srv->req.n;
+	p->req.next = 0;
+	p->req.skip = 0;
+	p->req.chunks = NULL;
+	p->async = async;
+	p->next = NULL;
+
+	for (last = &srv->pending; *last != NULL; last = &(*last)->next);
+	*last = p;
+	srv->npending++;
+	if (async->npending++ == 0) R_PreserveObject(async->data);
+
+	if (mcon->io != NULL){
+	    srv->req.status = MC_DONE; /* it's the I/O thread's now */
+	    if (!io_submit(mcon,srv)) close_srv(srv);
+	}
+    }
+
+    release_iobufs(mcon);
+}
+
+/*
+ * Get the values of keys without waiting for them. Keys in the near
+ * cache are taken from it at once.
+ *
+ * Returns a handle to pass to mc_wait() or mc_collect().
+ */
+SEXP mc_get_async(SEXP mcon_s, SEXP keys){
+    int i, k, m, *keyidx, *start, *idx;
+    mc_async *async;
+    mc_srv *srv;
+    SEXP handle, data, value, near, cached;
     mc_con *mcon = unmarshall_con(mcon_s);
-    if (!mcon) return R_NilValue;
 
-    /* Determine which server we'll be working with */
-    i = hash_servers(mcon,key_s);
-    if (i == -1) return R_NilValue;
-    srv = mcon->servers[i];
+    if (!mcon) return R_NilValue;
 
-    /* Connect to it */
-    if (srv->scon == -1 && (srv->scon = mc_SockConnect(srv->port,srv->host)) == -1)
+    if (!isString(keys)){
+	warning("rmemcache: keys must be a character vector!");
 	return R_NilValue;
+    }
+
+    PROTECT(handle = new_async(mcon_s,keys,TRUE,&async));
+    async->invalidations = mcon->near.invalidations;
+    data = R_ExternalPtrProtected(handle);
+    SET_VECTOR_ELT(data,MC_ASYNC_RESULT,value = allocVector(VECSXP,LENGTH(keys)));
+    setAttrib(value,R_NamesSymbol,keys);
+    SET_VECTOR_ELT(data,MC_ASYNC_NEAR,near = allocVector(LGLSXP,LENGTH(keys)));
+    for (i = 0; i < LENGTH(keys); i++){
+	cached = (mcon->near.budget > 0)? get_near(mcon,CHAR(STRING_ELT(keys,i))) : NULL;
+	LOGICAL(near)[i] = (cached != NULL);
+	if (cached != NULL) SET_VECTOR_ELT(value,i,cached);
+    }
+
+    begin_async(mcon);
+    group_keys(mcon,keys,&keyidx,&start);
+    for (i = 0; i < mcon->nservers; i++){
+	srv = mcon->servers[i];
+	idx = (int *)R_alloc(start[i+1] - start[i] + 1,sizeof(int));
+	for (k = start[i], m = 0; k < start[i+1]; k++)
+	    if (!LOGICAL(near)[keyidx[k]]) idx[m++] = keyidx[k];
+	if (m == 0 || !init_request(mcon,srv,NULL,keys,value,idx,m))
+	    continue;
+
+	if (mcon->protocol == MC_PROTO_BINARY)
+	    append_bin_get_cmd(srv->obuf,keys,idx,m);
+	else
+	    append_get_cmd(srv->obuf,keys,idx,m);
+	queue_cmd(srv,0);
+    }
+    write_async(mcon,async,(mcon->protocol == MC_PROTO_BINARY)?
+	    parse_bin_get_reply : parse_get_reply);
+
+    UNPROTECT(1);
+    return handle;
+}
+
+/*
+ * Store values under keys with cmd without waiting for the servers to
+ * reply. Values too large to be queued with the others are stored when
+ * the handle is collected.
+ *
+ * Returns a handle to pass to mc_wait() or mc_collect().
+ */
+SEXP mc_store_async(SEXP mcon_s, SEXP keys, SEXP values, SEXP exptime, SEXP cmd){
+    int i, j, k, m, nkeys, nrep, napart = 0, opcode = 0, flags, queued;
+    int *keyidx, *start, *idx, *apart;
+    size_t hdrpos, size;
+    mc_async *async;
+    mc_srv *srv;
+    SEXP handle, data, copies, stored, aparts;
+    mc_con *mcon = unmarshall_con(mcon_s);
 
-    /* Send delete command */
-    key = CHAR(STRING_ELT(key_s,0));
-    if ((mcon->obuf = init_delete_buf(key,asInteger(noReply))) == NULL)
+    if (!mcon) return R_NilValue;
+
+    if (!isString(keys) || !isNewList(values) || LENGTH(keys) != LENGTH(values)){
+	warning("rmemcache: keys and values must be a character vector and list of the same length!");
 	return R_NilValue;
-    if (writeline_buf(srv,mcon->obuf) <= 0){
-	destroy_iobufs(mcon);
+    }
+    if (LENGTH(exptime) == 0){
+	warning("rmemcache: exptime must not be empty!");
 	return R_NilValue;
     }
+    if (mcon->protocol == MC_PROTO_BINARY)
+	opcode = bin_store_opcode(CHAR(STRING_ELT(cmd,0)));
+
+    nkeys = LENGTH(keys);
+    nrep = replica_count(mcon);
+    drop_near(mcon,keys);
+
+    PROTECT(copies = replicate_vector(keys,nkeys,nrep));
+    PROTECT(handle = new_async(mcon_s,copies,FALSE,&async));
+    async->nkeys = nkeys;
+    async->nrep = nrep;
+    data = R_ExternalPtrProtected(handle);
+    SET_VECTOR_ELT(data,MC_ASYNC_VALUES,values);
+    SET_VECTOR_ELT(data,MC_ASYNC_EXP,exptime);
+    SET_VECTOR_ELT(data,MC_ASYNC_CMD,cmd);
+    SET_VECTOR_ELT(data,MC_ASYNC_RESULT,stored = allocVector(LGLSXP,LENGTH(copies)));
+    for (i = 0; i < LENGTH(copies); i++) LOGICAL(stored)[i] = FALSE;
+
+    apart = (int *)R_alloc(nkeys + 1,sizeof(int));
+    for (j = 0; j < nkeys; j++) apart[j] = FALSE;
+
+    begin_async(mcon);
+    group_replicas(mcon,copies,nkeys,0,&keyidx,&start);
+    for (i = 0; i < mcon->nservers; i++){
+	if (start[i] == start[i+1]) continue;
+	srv = mcon->servers[i];
+	idx = (int *)R_alloc(start[i+1] - start[i],sizeof(int));
+	if (!init_request(mcon,srv,NULL,copies,stored,idx,0)) continue;
+
+	for (k = start[i], m = 0; k < start[i+1]; k++){
+	    j = keyidx[k] % nkeys;
+	    if (apart[j]) continue;
+	    if (mcon->protocol == MC_PROTO_BINARY){
+		hdrpos = append_bin_store_header(srv->obuf,opcode,
+			CHAR(STRING_ELT(keys,j)),
+			INTEGER(exptime)[j % LENGTH(exptime)],m);
+		queued = serialize_bin_store_buf(mcon,srv,hdrpos,
+			VECTOR_ELT(values,j),&flags,&size);
+	    } else {
+		hdrpos = append_store_header(srv->obuf,CHAR(STRING_ELT(cmd,0)),
+			CHAR(STRING_ELT(keys,j)));
+		queued = serialize_store_buf(mcon,srv,hdrpos,VECTOR_ELT(values,j),
+			INTEGER(exptime)[j % LENGTH(exptime)],FALSE,&flags,&size);
+	    }
+	    if (!queued){
+		apart[j] = TRUE;
+		napart++;
+		continue;
+	    }
+	    idx[m++] = keyidx[k];
+	}
 
-    if (asInteger(noReply) == TRUE){
-	destroy_iobufs(mcon);
-	return ScalarLogical(TRUE);
+	if ((srv->req.n = m) == 0){
+	    reset_request(srv);
+	    continue;
+	}
+	if (mcon->protocol == MC_PROTO_BINARY){
+	    hdrpos = srv->obuf->count;
+	    append_bin_noop(srv->obuf,m);
+	    queue_cmd(srv,hdrpos);
+	}
     }
+    write_async(mcon,async,(mcon->protocol == MC_PROTO_BINARY)?
+	    parse_bin_store_reply : parse_store_reply);
 
-    /* Otherwise we need to read response from server */
-    if ((mcon->ibuf = init_buf(1)) == NULL){ 
-	destroy_iobufs(mcon);
-	return R_NilValue;
+    if (napart > 0){
+	SET_VECTOR_ELT(data,MC_ASYNC_APART,aparts = allocVector(INTSXP,napart));
+	for (j = 0, k = 0; j < nkeys; j++)
+	    if (apart[j]) INTEGER(aparts)[k++] = j;
     }
 
-    response = readline_buf(srv,mcon->ibuf);
+    UNPROTECT(2);
+    return handle;
+}
 
-    /* Network error or server sent an error message */
-    if (response == NULL || error_occured(response)){
-	destroy_iobufs(mcon);
-	return R_NilValue;
+/* Waits for the replies to handle, then finishes its async: a get
+ * fetches chunked values and the keys missing from their other copies
+ * and fills the near cache, unless it was invalidated since the get
+ * began, a store stores the values kept apart. The
+ * result is kept, so it's finished only once. Returns what mc_get_multi()
+ * or mc_store_multi() would have.
+ */
+static SEXP collect_async(SEXP handle){
+    int i, j, fresh;
+    mc_async *async = unmarshall_async(handle);
+    SEXP data = R_ExternalPtrProtected(handle), keys, value, near, aparts;
+    SEXP values, exptime, akeys, avalues, aexptime, stored;
+    mc_con *mcon = unmarshall_con(VECTOR_ELT(data,MC_ASYNC_CON));
+
+    if (VECTOR_ELT(data,MC_ASYNC_VALUE) != R_NilValue)
+	return VECTOR_ELT(data,MC_ASYNC_VALUE);
+    if (async->npending > 0) read_pending(mcon,async);
+
+    keys = VECTOR_ELT(data,MC_ASYNC_KEYS);
+    value = VECTOR_ELT(data,MC_ASYNC_RESULT);
+
+    if (async->get){
+	/* Values read before a write through mcon may be stale now */
+	fresh = (mcon->near.invalidations == async->invalidations);
+	get_chunked(mcon,keys,value);
+	failover_values(mcon,keys,value);
+	near = VECTOR_ELT(data,MC_ASYNC_NEAR);
+	if (mcon->near.budget > 0 && fresh)
+	    for (i = 0; i < LENGTH(keys); i++)
+		if (!LOGICAL(near)[i])
+		    put_near(mcon,CHAR(STRING_ELT(keys,i)),VECTOR_ELT(value,i));
+    } else {
+	value = fold_replicas(value,async->nkeys,async->nrep);
+	SET_VECTOR_ELT(data,MC_ASYNC_RESULT,value);
+
+	aparts = VECTOR_ELT(data,MC_ASYNC_APART);
+	if (aparts != R_NilValue){
+	    values = VECTOR_ELT(data,MC_ASYNC_VALUES);
+	    exptime = VECTOR_ELT(data,MC_ASYNC_EXP);
+	    PROTECT(akeys = allocVector(STRSXP,LENGTH(aparts)));
+	    PROTECT(avalues = allocVector(VECSXP,LENGTH(aparts)));
+	    PROTECT(aexptime = allocVector(INTSXP,LENGTH(aparts)));
+	    for (i = 0; i < LENGTH(aparts); i++){
+		j = INTEGER(aparts)[i];
+		SET_STRING_ELT(akeys,i,STRING_ELT(keys,j));
+		SET_VECTOR_ELT(avalues,i,VECTOR_ELT(values,j));
+		INTEGER(aexptime)[i] = INTEGER(exptime)[j % LENGTH(exptime)];
+	    }
+	    stored = store_values(mcon,akeys,avalues,aexptime,
+		    VECTOR_ELT(data,MC_ASYNC_CMD),FALSE);
+	    for (i = 0; i < LENGTH(aparts); i++)
+		LOGICAL(value)[INTEGER(aparts)[i]] = LOGICAL(stored)[i];
+	    UNPROTECT(3);
+	}
     }
 
-    if (strcmp("DELETED\r",response) == 0){
-	destroy_iobufs(mcon);
-	return ScalarLogical(TRUE);
+    release_iobufs(mcon);
+    SET_VECTOR_ELT(data,MC_ASYNC_VALUE,value);
+    return value;
+}
+
+/*
+ * Wait for the replies to a handle, or a list of handles.
+ *
+ * Returns a logical vector, TRUE for each handle whose servers all
+ * replied.
+ */
+SEXP mc_wait(SEXP handles){
+    int i, n = (isNewList(handles))? LENGTH(handles) : 1;
+    mc_async *async;
+    mc_con *mcon;
+    SEXP handle, ok;
+
+    PROTECT(ok = allocVector(LGLSXP,n));
+    for (i = 0; i < n; i++){
+	handle = (isNewList(handles))? VECTOR_ELT(handles,i) : handles;
+	async = unmarshall_async(handle);
+	mcon = unmarshall_con(VECTOR_ELT(R_ExternalPtrProtected(handle),MC_ASYNC_CON));
+	if (async->npending > 0) read_pending(mcon,async);
+	LOGICAL(ok)[i] = (async->failed == 0);
     }
+    UNPROTECT(1);
+    return ok;
+}
 
-    /* Success! */
-    if (strcmp("NOT_FOUND\r",response) == 0){
-	destroy_iobufs(mcon);
-	return ScalarLogical(FALSE);
+/*
+ * Collect the result of a handle, waiting for it if need be, or those
+ * of a list of handles as a list.
+ */
+SEXP mc_collect(SEXP handles){
+    int i;
+    SEXP results;
+
+    if (!isNewList(handles)) return collect_async(handles);
+
+    PROTECT(results = allocVector(VECSXP,LENGTH(handles)));
+    for (i = 0; i < LENGTH(handles); i++)
+	SET_VECTOR_ELT(results,i,collect_async(VECTOR_ELT(handles,i)));
+    UNPROTECT(1);
+    return results;
+}
+
+/* Runs op, "set" or "get", over nkeys keys holding value_size bytes
+ * for duration seconds, calling store_values() or get_values() in a
+ * loop with concurrency keys at a time, one being what mc_store() and
+ * mc_get() do and more what their batch variants do. Keys are set
+ * before they're got. Returns a list of the keys done per second and
+ * the latency of each call in microseconds.
+ */
+SEXP mc_benchmark(SEXP mcon_s, SEXP op_s, SEXP nkeys_s, SEXP size_s,
+	SEXP concurrency_s, SEXP duration_s){
+    int i, j, set, nkeys, size, conc, calls = 0, failed = 0;
+    long next = 0;
+    double duration, start, t, elapsed;
+    char key[64];
+    const void *vmax;
+    mc_hist *hist;
+    SEXP keys, value, batch, values, exptime, cmd, res, ret, names, latency, lnames;
+    mc_con *mcon = unmarshall_con(mcon_s);
+    if (!mcon) return R_NilValue;
+
+    if (!isString(op_s) || LENGTH(op_s) != 1 ||
+	    (strcmp(CHAR(STRING_ELT(op_s,0)),"set") != 0 &&
+	     strcmp(CHAR(STRING_ELT(op_s,0)),"get") != 0)){
+	warning("rmemcache: op must be \"set\" or \"get\"");
+	return R_NilValue;
+    }
+    set = (strcmp(CHAR(STRING_ELT(op_s,0)),"set") == 0);
+    nkeys = asInteger(nkeys_s);
+    size = asInteger(size_s);
+    conc = asInteger(concurrency_s);
+    duration = asReal(duration_s);
+    if (nkeys == NA_INTEGER || nkeys < 1 || size == NA_INTEGER || size < 0 ||
+	    conc == NA_INTEGER || conc < 1 || ISNAN(duration) || duration <= 0){
+	warning("rmemcache: nkeys and concurrency must be positive, value_size non-negative and duration positive");
+	return R_NilValue;
     }
+    if (conc > nkeys) conc = nkeys;
 
-    /* shouldn't ever get here */
-    destroy_iobufs(mcon);
-    return R_NilValue;
+    PROTECT(keys = allocVector(STRSXP,nkeys));
+    for (i = 0; i < nkeys; i++){
+	sprintf(key,"rmemcache:bench:%d",i);
+	SET_STRING_ELT(keys,i,mkChar(key));
+    }
+    PROTECT(value = allocVector(RAWSXP,size));
+    for (i = 0; i < size; i++) RAW(value)[i] = (Rbyte)(i * 31);
+    PROTECT(exptime = ScalarInteger(0));
+    PROTECT(cmd = mkString("set"));
+    hist = (mc_hist *)R_alloc(1,sizeof(mc_hist));
+    memset(hist,0,sizeof(mc_hist));
+
+    /* Set every key first, untimed, for gets to find */
+    if (!set){
+	for (i = 0; i < nkeys; i += MC_STORE_BATCH){
+	    vmax = vmaxget();
+	    PROTECT(batch = allocVector(STRSXP,(nkeys - i < MC_STORE_BATCH)? nkeys - i : MC_STORE_BATCH));
+	    PROTECT(values = allocVector(VECSXP,LENGTH(batch)));
+	    for (j = 0; j < LENGTH(batch); j++){
+		SET_STRING_ELT(batch,j,STRING_ELT(keys,i + j));
+		SET_VECTOR_ELT(values,j,value);
+	    }
+	    store_values(mcon,batch,values,exptime,cmd,FALSE);
+	    UNPROTECT(2);
+	    vmaxset(vmax);
+	}
+    }
+
+    PROTECT(batch = allocVector(STRSXP,conc));
+    PROTECT(values = allocVector(VECSXP,conc));
+    for (j = 0; j < conc; j++) SET_VECTOR_ELT(values,j,value);
+
+    start = monotonic_time();
+    do {
+	for (j = 0; j < conc; j++, next++)
+	    SET_STRING_ELT(batch,j,STRING_ELT(keys,next % nkeys));
+
+	/* Scratch memory is given back each call, lest it pile up */
+	vmax = vmaxget();
+	t = monotonic_time();
+	res = (set)? store_values(mcon,batch,values,exptime,cmd,FALSE) :
+	    get_values(mcon,batch);
+	elapsed = monotonic_time() - t;
+	hist_record(hist,elapsed);
+	for (j = 0; j < conc; j++)
+	    if ((set)? LOGICAL(res)[j] != TRUE : VECTOR_ELT(res,j) == R_NilValue)
+		failed++;
+	vmaxset(vmax);
+
+	if (++calls % 1024 == 0) R_CheckUserInterrupt();
+    } while ((t += elapsed) < start + duration);
+    elapsed = t - start;
+
+    PROTECT(ret = allocVector(VECSXP,7));
+    PROTECT(names = allocVector(STRSXP,7));
+    SET_VECTOR_ELT(ret,0,mkString((set)? "set" : "get"));
+    SET_STRING_ELT(names,0,mkChar("op"));
+    SET_VECTOR_ELT(ret,1,ScalarReal((double)calls * conc));
+    SET_STRING_ELT(names,1,mkChar("keys"));
+    SET_VECTOR_ELT(ret,2,ScalarReal((double)calls));
+    SET_STRING_ELT(names,2,mkChar("calls"));
+    SET_VECTOR_ELT(ret,3,ScalarReal(elapsed));
+    SET_STRING_ELT(names,3,mkChar("seconds"));
+    SET_VECTOR_ELT(ret,4,ScalarReal((double)calls * conc / elapsed));
+    SET_STRING_ELT(names,4,mkChar("keysPerSec"));
+    SET_VECTOR_ELT(ret,5,ScalarReal((double)failed));
+    SET_STRING_ELT(names,5,mkChar("failed"));
+
+    PROTECT(latency = allocVector(REALSXP,5));
+    PROTECT(lnames = allocVector(STRSXP,5));
+    REAL(latency)[0] = hist->sum / hist->n * 1e-3;
+    SET_STRING_ELT(lnames,0,mkChar("mean"));
+    REAL(latency)[1] = hist_quantile(hist,0.5) * 1e6;
+    SET_STRING_ELT(lnames,1,mkChar("p50"));
+    REAL(latency)[2] = hist_quantile(hist,0.99) * 1e6;
+    SET_STRING_ELT(lnames,2,mkChar("p99"));
+    REAL(latency)[3] = hist_quantile(hist,0.999) * 1e6;
+    SET_STRING_ELT(lnames,3,mkChar("p999"));
+    REAL(latency)[4] = hist->max * 1e-3;
+    SET_STRING_ELT(lnames,4,mkChar("max"));
+    setAttrib(latency,R_NamesSymbol,lnames);
+    SET_VECTOR_ELT(ret,6,latency);
+    SET_STRING_ELT(names,6,mkChar("latency"));
+    setAttrib(ret,R_NamesSymbol,names);
+
+    UNPROTECT(10);
+    return ret;
 }
 
-SEXP mc_incr(SEXP mcon, SEXP key, SEXP byval){
-    return R_NilValue;
+static const char *mc_latency_names[5] = { "mean", "p50", "p99", "p999", "max" };
+
+/* Returns a data frame of nrow rows and the columns names, the first
+ * nstr of them character and the rest numeric, with latency columns
+ * appended if latency.
+ */
+static SEXP new_frame(int nrow, int ncol, const char **names, int nstr,
+	int latency){
+    int j, n = ncol + ((latency)? 5 : 0);
+    SEXP frame, fnames, rownames;
+
+    PROTECT(frame = allocVector(VECSXP,n));
+    PROTECT(fnames = allocVector(STRSXP,n));
+    for (j = 0; j < n; j++){
+	SET_VECTOR_ELT(frame,j,allocVector((j < nstr)? STRSXP : REALSXP,nrow));
+	SET_STRING_ELT(fnames,j,mkChar((j < ncol)? names[j] : mc_latency_names[j - ncol]));
+    }
+    setAttrib(frame,R_NamesSymbol,fnames);
+    PROTECT(rownames = allocVector(INTSXP,2));
+    INTEGER(rownames)[0] = NA_INTEGER;
+    INTEGER(rownames)[1] = -nrow;
+    setAttrib(frame,R_RowNamesSymbol,rownames);
+    setAttrib(frame,R_ClassSymbol,mkString("data.frame"));
+    UNPROTECT(3);
+    return frame;
 }
 
-SEXP mc_decr(SEXP mcon, SEXP key, SEXP byval){
-    return R_NilValue;
+/* Puts the mean, quantiles and maximum of hist in microseconds, NA if
+ * it's empty, in row of the five columns of frame from col on.
+ */
+static void put_latency(SEXP frame, int col, int row, mc_hist *hist){
+    double *v[5];
+    int j;
+
+    for (j = 0; j < 5; j++) v[j] = REAL(VECTOR_ELT(frame,col + j)) + row;
+    if (hist->n == 0){
+	for (j = 0; j < 5; j++) *v[j] = NA_REAL;
+	return;
+    }
+    *v[0] = hist->sum / hist->n * 1e-3;
+    *v[1] = hist_quantile(hist,0.5) * 1e6;
+    *v[2] = hist_quantile(hist,0.99) * 1e6;
+    *v[3] = hist_quantile(hist,0.999) * 1e6;
+    *v[4] = hist->max * 1e-3;
 }
 
-SEXP mc_stats(SEXP mcon, SEXP args){
-    return R_NilValue;
+/*
+ * Get the metrics gathered since they were last reset, then reset them
+ * if reset. Returns a list of three data frames: ops, with the calls,
+ * keys, server errors and latency in microseconds of each operation;
+ * phases, with the time each operation spent in each phase of its
+ * requests; and servers, with the bytes sent to and received from each
+ * server. ops and phases are NULL unless the metrics option is on.
+ */
+SEXP mc_metrics(SEXP mcon_s, SEXP reset_s){
+    static const char *opcols[] = { "op", "calls", "keys", "errors" };
+    static const char *phasecols[] = { "op", "phase", "count" };
+    static const char *srvcols[] = { "server", "bytesSent", "bytesReceived" };
+    int i, j, row, reset = asLogical(reset_s) == TRUE;
+    char *name;
+    mc_meter *m;
+    mc_srv *srv;
+    SEXP ret, names, ops, phases, servers;
+    mc_con *mcon = unmarshall_con(mcon_s);
+
+    if (!mcon) return R_NilValue;
+    m = mcon->metrics;
+
+    PROTECT(ret = allocVector(VECSXP,3));
+    PROTECT(names = allocVector(STRSXP,3));
+    SET_STRING_ELT(names,0,mkChar("ops"));
+    SET_STRING_ELT(names,1,mkChar("phases"));
+    SET_STRING_ELT(names,2,mkChar("servers"));
+    setAttrib(ret,R_NamesSymbol,names);
+
+    if (m){
+	SET_VECTOR_ELT(ret,0,ops = new_frame(MC_NOPS,4,opcols,1,TRUE));
+	SET_VECTOR_ELT(ret,1,phases = new_frame(MC_NOPS * MC_NPHASES,3,phasecols,2,TRUE));
+	for (i = 0; i < MC_NOPS; i++){
+	    SET_STRING_ELT(VECTOR_ELT(ops,0),i,mkChar(mc_op_names[i]));
+	    REAL(VECTOR_ELT(ops,1))[i] = (double)m->calls[i];
+	    REAL(VECTOR_ELT(ops,2))[i] = (double)m->keys[i];
+	    REAL(VECTOR_ELT(ops,3))[i] = (double)m->errors[i];
+	    put_latency(ops,4,i,&m->latency[i]);
+	    for (j = 0; j < MC_NPHASES; j++){
+		row = i * MC_NPHASES + j;
+		SET_STRING_ELT(VECTOR_ELT(phases,0),row,mkChar(mc_op_names[i]));
+		SET_STRING_ELT(VECTOR_ELT(phases,1),row,mkChar(mc_phase_names[j]));
+		REAL(VECTOR_ELT(phases,2))[row] = (double)m->phase[i][j].n;
+		put_latency(phases,3,row,&m->phase[i][j]);
+	    }
+	}
+	if (reset){
+	    memset(m,0,sizeof(mc_meter));
+	    m->op = -1;
+	}
+    }
+
+    SET_VECTOR_ELT(ret,2,servers = new_frame(mcon->nservers,3,srvcols,1,FALSE));
+    for (i = 0; i < mcon->nservers; i++){
+	srv = mcon->servers[i];
+	name = R_alloc(strlen(srv->host) + 16,1);
+	server_name(srv,name);
+	SET_STRING_ELT(VECTOR_ELT(servers,0),i,mkChar(name));
+	REAL(VECTOR_ELT(servers,1))[i] = (double)srv->sent;
+	REAL(VECTOR_ELT(servers,2))[i] = (double)srv->received;
+	if (reset) srv->sent = srv->received = 0;
+    }
+
+    UNPROTECT(2);
+    return ret;
 }
 
 SEXP mc_flushall(SEXP mcon, SEXP exptime){
@@ -924,10 +6002,25 @@ SEXP mc_version(SEXP mcon){
     return R_NilValue;
 }
 
+/*
+ * Write the noreply commands waiting in quiet batches now. Returns FALSE
+ * if a server couldn't be written to, its commands being lost.
+ */
+SEXP mc_flush(SEXP mcon_s){
+    int ok;
+    mc_con *mcon = unmarshall_con(mcon_s);
+    if (!mcon) return ScalarLogical(FALSE);
+
+    ok = flush_quiet(mcon,0);
+    release_iobufs(mcon);
+    return ScalarLogical(ok);
+}
+
 SEXP mc_disconnect(SEXP mcon_s){
     mc_con *mcon = unmarshall_con(mcon_s);
     if (!mcon) return ScalarLogical(FALSE);
 
+    flush_quiet(mcon,0);
     return ScalarLogical(close_sockets(mcon));
 }
 
@@ -935,16 +6028,31 @@ SEXP mc_disconnect(SEXP mcon_s){
 
 R_CallMethodDef callMethods[] = 
 {
-    CALLDEF(mc_connect,2),
-    CALLDEF(mc_setservers,2),
+    CALLDEF(mc_connect,5),
+    CALLDEF(mc_setservers,4),
     CALLDEF(mc_hashfun,2),
     CALLDEF(mc_hash,2),
-    CALLDEF(mc_store,5),
+    CALLDEF(mc_store,6),
+    CALLDEF(mc_store_multi,6),
     CALLDEF(mc_get,2),
+    CALLDEF(mc_get_multi,2),
     CALLDEF(mc_delete,3),
-    CALLDEF(mc_incr,3),
-    CALLDEF(mc_decr,3),
+    CALLDEF(mc_compress,3),
+    CALLDEF(mc_chunk,2),
+    CALLDEF(mc_format,3),
+    CALLDEF(mc_nearcache,3),
+    CALLDEF(mc_options,2),
+    CALLDEF(mc_incr,4),
+    CALLDEF(mc_decr,4),
+    CALLDEF(mc_counter_multi,5),
     CALLDEF(mc_stats,2),
+    CALLDEF(mc_benchmark,6),
+    CALLDEF(mc_metrics,2),
+    CALLDEF(mc_get_async,2),
+    CALLDEF(mc_store_async,5),
+    CALLDEF(mc_wait,1),
+    CALLDEF(mc_collect,1),
+    CALLDEF(mc_flush,1),
     CALLDEF(mc_flushall,2),
     CALLDEF(mc_version,1),
     CALLDEF(mc_disconnect,1),
@@ -956,6 +6064,7 @@ R_CallMethodDef callMethods[] =
 void R_init_rmemcache(DllInfo *dll)
 {
     MCCON_type_tag = install("MCCON_type_tag");
+    MCASYNC_type_tag = install("MCASYNC_type_tag");
     R_registerRoutines(dll,NULL,callMethods,NULL,NULL);
 }
 
@@ -27,6 +27,7 @@
 #include "sock.h"
 #include "config.h"
 
+#include <stdio.h>
 #include <string.h>
 
 #ifdef Win32
@@ -45,6 +46,12 @@
 #ifdef HAVE_NETINET_IN_H
 #include <netinet/in.h>
 #endif
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+#ifdef HAVE_SYS_UN_H
+#include <sys/un.h>
+#endif
 
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
@@ -55,11 +62,13 @@
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
-#ifdef HAVE_SYS_SELECT_H
-#include <sys/select.h>
-#endif
 
 #include <time.h>
+#include <limits.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 #ifndef Win32
 #include <unistd.h>
@@ -76,72 +85,157 @@ static int socket_errno(void)
 #endif
 }
 
-static unsigned int timeout = 2;
+/* Milliseconds on a clock that doesn't jump with the time of day, so
+ * that timeouts are measured rather than guessed.
+ */
+static double mc_ClockMs(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+#endif
+	return time(NULL) * 1e3;
+}
+
+/* Milliseconds left until deadline, 0 if it has passed */
+static int mc_MsLeft(double deadline)
+{
+	double left = deadline - mc_ClockMs();
+
+	if (left <= 0) return 0;
+	return (left >= INT_MAX) ? INT_MAX : (int) (left + 0.999);
+}
 
-/* Returns -1 on error
+/* Waits up to timeout milliseconds for sockfd to become readable, or
+ * writeable if write.
+ * Returns -1 on error
  * 0 on success, meaning the socket is ready for reading/writing
  * 1 on timeout
  */
-int mc_SocketWait(int sockfd, int write)
+int mc_SocketWait(int sockfd, int write, int timeout)
 {
-	fd_set rfd, wfd;
-	struct timeval tv;
-	double used = 0.0;
+	mc_pollfd pfd;
+	int howmany;
 
-	while(1) {
-		int maxfd = 0, howmany;
-#ifdef Win32
-		tv.tv_sec = 0;
-		tv.tv_usec = 2e5;
-#else
-		tv.tv_sec = timeout;
-		tv.tv_usec = 600;
-#endif
+	pfd.fd = sockfd;
+	pfd.events = write ? MC_POLLOUT : MC_POLLIN;
+	pfd.revents = 0;
 
+	howmany = mc_SocketPoll(&pfd, 1, timeout);
+	if (howmany < 0) return -1;
+	if (howmany == 0) return 1;
+	return 0;
+}
 
-		FD_ZERO(&rfd);
-		FD_ZERO(&wfd);
+/* Resolves host and port into addr. host may be a name or an IPv4 or
+ * IPv6 literal, and the first address found is used. Returns 0 on
+ * success, -1 if host can't be resolved.
+ */
+int mc_SockResolve(const char *host, int port, mc_addr *addr)
+{
+#ifdef HAVE_GETADDRINFO
+	struct addrinfo hints, *res;
+	char service[16];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	sprintf(service, "%d", port);
+
+	if (getaddrinfo(host, service, &hints, &res) != 0)
+		return -1;
+	if (res->ai_addrlen > sizeof(addr->addr)) {
+		freeaddrinfo(res);
+		return -1;
+	}
+	memcpy(&addr->addr, res->ai_addr, res->ai_addrlen);
+	addr->len = (int) res->ai_addrlen;
+	addr->family = res->ai_family;
+	freeaddrinfo(res);
+#else
+	struct sockaddr_in *server = (struct sockaddr_in *) &addr->addr;
+	struct hostent *hp;
 
-		if(write) FD_SET(sockfd, &wfd); else FD_SET(sockfd, &rfd);
-		maxfd = sockfd;
+	if (! (hp = gethostbyname(host)) || hp->h_addrtype != AF_INET)
+		return -1;
 
-		/* increment used value _before_ the select in case select
-		   modifies tv (as Linux does) */
-		used += tv.tv_sec + 1e-6 * tv.tv_usec;
+	memset(server, 0, sizeof(*server));
+	memcpy((char *)&server->sin_addr, hp->h_addr_list[0], hp->h_length);
+	server->sin_port = htons((short)port);
+	server->sin_family = AF_INET;
+	addr->len = sizeof(*server);
+	addr->family = AF_INET;
+#endif
+	return 0;
+}
 
-		howmany = select(maxfd+1, &rfd, &wfd, NULL, &tv);
+/* Fills in addr for the Unix domain socket at path. Returns -1 if path
+ * is too long or Unix domain sockets aren't supported.
+ */
+int mc_SockUnixAddr(const char *path, mc_addr *addr)
+{
+#if defined(HAVE_SYS_UN_H) && defined(AF_UNIX)
+	struct sockaddr_un *server = (struct sockaddr_un *) &addr->addr;
 
-		if (howmany < 0) {
-			if (socket_errno() == EINTR) continue;
-			return -1;
-		}
-		if (howmany == 0) {
-			if(used >= timeout) return 1;
-			continue;
-		}
+	if (strlen(path) >= sizeof(server->sun_path))
+		return -1;
 
-		/* the socket was ready */
-		break;
-	}
+	memset(server, 0, sizeof(*server));
+	server->sun_family = AF_UNIX;
+	strcpy(server->sun_path, path);
+	addr->len = sizeof(*server);
+	addr->family = AF_UNIX;
 	return 0;
+#else
+	return -1;
+#endif
 }
 
-void mc_SockTimeout(int delay)
+/* Sets opts on s. Buffer sizes have to be set before connecting for
+ * the TCP window to be scaled to match. Returns -1 on error.
+ */
+static int mc_SockSetopts(SOCKET s, int family, const mc_sockopts *opts)
 {
-	timeout = (unsigned int) delay;
+	int one = 1;
+
+	if (opts->keepalive &&
+		setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, (char *)&one, sizeof(one)) != 0)
+		return -1;
+#ifdef TCP_NODELAY
+	if (opts->nodelay && (family == AF_INET
+#ifdef AF_INET6
+		|| family == AF_INET6
+#endif
+		) &&
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one)) != 0)
+		return -1;
+#endif
+	if (opts->sndbuf > 0 && setsockopt(s, SOL_SOCKET, SO_SNDBUF,
+		(char *)&opts->sndbuf, sizeof(opts->sndbuf)) != 0)
+		return -1;
+	if (opts->rcvbuf > 0 && setsockopt(s, SOL_SOCKET, SO_RCVBUF,
+		(char *)&opts->rcvbuf, sizeof(opts->rcvbuf)) != 0)
+		return -1;
+	return 0;
 }
 
-int mc_SockConnect(int port, char *host)
+/* Starts a non-blocking connect to addr, with opts if not NULL. Returns
+ * the socket, or -1 on error. *inprogress is set if the connect hasn't
+ * completed yet, in which case the socket becomes writeable once it
+ * has and mc_SockConnectDone() tells whether it succeeded.
+ */
+int mc_SockConnectStart(const mc_addr *addr, const mc_sockopts *opts,
+	int *inprogress)
 {
 	SOCKET s;
-	fd_set wfd, rfd;
-	struct timeval tv;
 	int status = 0;
-	double used = 0.0;
-	struct sockaddr_in server;
-	struct hostent *hp;
 
-	s = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	*inprogress = 0;
+
+	s = socket(addr->family, SOCK_STREAM, 0);
 	if (s == -1)  return -1;
 
 #ifdef Win32
@@ -157,19 +251,13 @@ int mc_SockConnect(int port, char *host)
 		status = fcntl(s, F_SETFL, status);
 	}
 #endif
-	if (status < 0) {
+#endif
+	if (status < 0 || (opts && mc_SockSetopts(s, addr->family, opts) != 0)) {
 		closesocket(s);
 		return(-1);
 	}
-#endif
 
-	if (! (hp = gethostbyname(host))) return -1;
-
-	memcpy((char *)&server.sin_addr, hp->h_addr_list[0], hp->h_length);
-	server.sin_port = htons((short)port);
-	server.sin_family = AF_INET;
-
-	if ((connect(s, (struct sockaddr *) &server, sizeof(server)) == -1)) {
+	if ((connect(s, (struct sockaddr *) &addr->addr, addr->len) == -1)) {
 
 		switch (socket_errno()) {
 			case EISCONN:
@@ -177,60 +265,53 @@ int mc_SockConnect(int port, char *host)
 				break;
 			case EINPROGRESS:
 			case EWOULDBLOCK:
+				*inprogress = 1;
+				return s;
 				break;
 			default:
 				closesocket(s);
 				return(-1);
 		}
-	} else {
-		return s; /* do we really need to check for writeability? */
 	}
 
-	while(1) {
-		int maxfd = 0;
-#ifdef Win32
-		tv.tv_sec = 0;
-		tv.tv_usec = 2e5;
-#else
-		tv.tv_sec = timeout;
-		tv.tv_usec = 600;
-#endif
+	return s; /* do we really need to check for writeability? */
+}
 
-		FD_ZERO(&rfd);
-		FD_ZERO(&wfd);
-		FD_SET(s, &wfd);
-		if(maxfd < s) maxfd = s;
-
-		switch(select(maxfd+1, &rfd, &wfd, NULL, &tv))
-		{
-			case 0:
-				/* Time out */
-				used += tv.tv_sec + 1e-6 * tv.tv_usec;
-				if(used < timeout) continue;
-				closesocket(s);
-				return(-1);
-			case -1:
-				/* Ermm.. ?? */
-				closesocket(s);
-				return(-1);
-		}
+/* Returns 0 if the connect started on s by mc_SockConnectStart()
+ * succeeded, -1 otherwise. s must be writeable.
+ */
+int mc_SockConnectDone(int s)
+{
+	int status = 0;
+	socklen_t len;
 
-		if ( FD_ISSET(s, &wfd) ) {
-			socklen_t len;
-			len = sizeof(status);
-			if (getsockopt(s, SOL_SOCKET, SO_ERROR, (char*)&status, &len) < 0){
-				/* Solaris error code */
-				return (-1);
-			}
-			if ( status ) {
-				closesocket(s);
-				errno = status;
-				return (-1);
-			} else return(s);
-		}
+	len = sizeof(status);
+	if (getsockopt(s, SOL_SOCKET, SO_ERROR, (char*)&status, &len) < 0){
+		/* Solaris error code */
+		return (-1);
+	}
+	if ( status ) {
+		errno = status;
+		return (-1);
 	}
-	/* not reached */
-	return(-1);
+	return 0;
+}
+
+int mc_SockConnect(const mc_addr *addr, const mc_sockopts *opts, int timeout)
+{
+	SOCKET s;
+	int inprogress;
+
+	if ((s = mc_SockConnectStart(addr, opts, &inprogress)) == -1)
+		return -1;
+
+	if (inprogress &&
+		(mc_SocketWait(s, 1, timeout) != 0 || mc_SockConnectDone(s) != 0)) {
+		closesocket(s);
+		return(-1);
+	}
+
+	return s;
 }
 
 int mc_SockClose(int sockp)
@@ -238,31 +319,34 @@ int mc_SockClose(int sockp)
     return closesocket(sockp);
 }
 
-/* When blocking:
+/* When timeout > 0, waits up to timeout milliseconds for data:
  *   a return value of 0 either means client closed connection or an
  *   error or a timeout occured.
- *   a negative return value means either an error in select recv.
+ *   a negative return value means either an error in poll or recv.
  *
- * When non-blocking:
+ * When timeout is 0:
  *   a return value of 0 probably means no data to read.
  * 	 a negative return value means error in recv().
  */
-int mc_SockRead(int sockp, void *buf, int len, int blocking)
+int mc_SockRead(int sockp, void *buf, int len, int timeout)
 {
     int res;
 
-    if(blocking && mc_SocketWait(sockp, 0) != 0) return 0;
+    if(timeout > 0 && mc_SocketWait(sockp, 0, timeout) != 0) return 0;
     res = (int) read(sockp, buf, len);
     return (res >= 0) ? res : -socket_errno();
 }
 
-/* Blocking write: if return val != len then a send() timed out */
-int mc_SockWrite(int sockp, const void *buf, int len)
+/* Blocking write taking at most timeout milliseconds in all: if return
+ * val != len then a send() timed out
+ */
+int mc_SockWrite(int sockp, const void *buf, int len, int timeout)
 {
 	int res, out = 0;
+	double deadline = mc_ClockMs() + timeout;
 
 	do {
-		if(mc_SocketWait(sockp, 1) != 0) return out;
+		if(mc_SocketWait(sockp, 1, mc_MsLeft(deadline)) != 0) return out;
 		res = (int) send(sockp, buf, len, 0);
 		if (res < 0) {
 			switch(socket_errno()){
@@ -283,3 +367,86 @@ int mc_SockWrite(int sockp, const void *buf, int len)
 	} while (len > 0);
 	return out;
 }
+
+/* Non-blocking gather write of iovcnt buffers. Returns the number of
+ * bytes written, which is 0 if the socket isn't ready, or a negative
+ * value on error.
+ */
+int mc_SockSendv(int sockp, struct iovec *iov, int iovcnt)
+{
+	int res;
+#ifdef Win32
+	int i, out = 0;
+
+	for (i = 0; i < iovcnt; i++){
+		res = send(sockp, iov[i].iov_base, iov[i].iov_len, 0);
+		if (res < 0) break;
+		out += res;
+		if (res != iov[i].iov_len) return out;
+	}
+	if (out > 0) return out;
+#else
+	res = (int) writev(sockp, iov, (iovcnt > IOV_MAX)? IOV_MAX : iovcnt);
+	if (res >= 0) return res;
+#endif
+	switch(socket_errno()){
+		case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+		case EINTR:
+		case ENOBUFS:
+			return 0;
+			break;
+		default:
+			return -socket_errno();
+			break;
+	}
+}
+
+/* Waits up to timeout milliseconds for any of fds to become ready.
+ * Returns the number of ready fds, 0 on timeout, -1 on error. Unlike
+ * select(), poll() takes fds of any value, however many the process has
+ * open; Windows, which lacks it, doesn't limit fd values either.
+ */
+int mc_SocketPoll(mc_pollfd *fds, int nfds, int timeout)
+{
+#ifdef Win32
+	fd_set rfd, wfd, efd;
+	struct timeval tv;
+	int i, maxfd = 0, howmany;
+
+	FD_ZERO(&rfd);
+	FD_ZERO(&wfd);
+	FD_ZERO(&efd);
+	for (i = 0; i < nfds; i++){
+		if (fds[i].events & MC_POLLIN) FD_SET(fds[i].fd, &rfd);
+		if (fds[i].events & MC_POLLOUT) FD_SET(fds[i].fd, &wfd);
+		FD_SET(fds[i].fd, &efd);
+		if (maxfd < fds[i].fd) maxfd = fds[i].fd;
+	}
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	howmany = select(maxfd+1, &rfd, &wfd, &efd, &tv);
+	if (howmany <= 0) return howmany;
+
+	for (i = 0; i < nfds; i++){
+		fds[i].revents = 0;
+		if (FD_ISSET(fds[i].fd, &rfd)) fds[i].revents |= MC_POLLIN;
+		if (FD_ISSET(fds[i].fd, &wfd)) fds[i].revents |= MC_POLLOUT;
+		if (FD_ISSET(fds[i].fd, &efd)) fds[i].revents |= MC_POLLERR;
+	}
+	return howmany;
+#else
+	int howmany;
+	double deadline = mc_ClockMs() + timeout;
+
+	/* An interrupted poll() is resumed for the time left */
+	while ((howmany = poll(fds, nfds, timeout)) < 0 &&
+		socket_errno() == EINTR)
+		timeout = mc_MsLeft(deadline);
+
+	return howmany;
+#endif
+}
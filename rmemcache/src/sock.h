@@ -1,8 +1,57 @@
+#ifdef Win32
+#include <stddef.h>
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+typedef struct {
+	int fd;
+	short events;
+	short revents;
+} mc_pollfd;
+#define MC_POLLIN  0x1
+#define MC_POLLOUT 0x4
+#define MC_POLLERR 0x8
+#else
+#include <sys/uio.h>
+#include <poll.h>
+typedef struct pollfd mc_pollfd;
+#define MC_POLLIN  POLLIN
+#define MC_POLLOUT POLLOUT
+#define MC_POLLERR (POLLERR|POLLHUP|POLLNVAL)
+#endif
+
+/* A server address, resolved once by mc_SockResolve() and connected to
+ * as often as needed. addr holds a struct sockaddr of the given family.
+ */
+typedef struct {
+	int family;
+	int len;
+	union {
+		char bytes[128];
+		long long align;
+	} addr;
+} mc_addr;
+
+/* Options set on each socket before it connects */
+typedef struct {
+	int nodelay;   /* disable Nagle's algorithm */
+	int keepalive; /* turn on TCP keepalive */
+	int sndbuf;    /* SO_SNDBUF and SO_RCVBUF in bytes, 0 for the default */
+	int rcvbuf;
+} mc_sockopts;
+
 /* sockets */
-void mc_SockTimeout(int delay);
 int mc_SockOpen(int port);
 int mc_SockListen(int sockp, char *buf, int len);
-int mc_SockConnect(int port, char *host);
+int mc_SockResolve(const char *host, int port, mc_addr *addr);
+int mc_SockUnixAddr(const char *path, mc_addr *addr);
+int mc_SockConnect(const mc_addr *addr, const mc_sockopts *opts, int timeout);
+int mc_SockConnectStart(const mc_addr *addr, const mc_sockopts *opts,
+	int *inprogress);
+int mc_SockConnectDone(int s);
 int mc_SockClose(int sockp);
-int mc_SockRead(int sockp, void *buf, int maxlen, int blocking);
-int mc_SockWrite(int sockp, const void *buf, int len);
+int mc_SockRead(int sockp, void *buf, int maxlen, int timeout);
+int mc_SockWrite(int sockp, const void *buf, int len, int timeout);
+int mc_SockSendv(int sockp, struct iovec *iov, int iovcnt);
+int mc_SocketPoll(mc_pollfd *fds, int nfds, int timeout);